@@ -1,17 +1,29 @@
 #ifndef __RIBOSOME_EXPIRATION_HPP
 #define __RIBOSOME_EXPIRATION_HPP
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <ctime>
 #include <iomanip>
 #include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
 #include <thread>
 #include <unordered_map>
 #include <vector>
 
+#include <poll.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
 #include <glog/logging.h>
 
+#include "ribosome/timing_wheel.hpp"
+
 namespace ioremap { namespace ribosome {
 
 static inline const char *print_time(const std::chrono::system_clock::time_point &tp, char *dst, int dsize)
@@ -35,68 +47,167 @@ public:
 	typedef std::function<void ()> callback_t;
 	typedef uint64_t token_t;
 
-	expiration() : m_thread(std::bind(&expiration::run, this)) {
+	enum backend_t {
+		// ordered map of expiration times, O(log n) insert and remove, exact wakeups
+		backend_map = 0,
+		// hierarchical timing wheel, O(1) insert and remove, timers fire at @resolution granularity
+		backend_wheel,
+	};
+
+	typedef std::function<void (std::function<void ()> &&task)> executor_t;
+
+	struct options {
+		backend_t backend = backend_map;
+		std::chrono::nanoseconds resolution = std::chrono::milliseconds(1);
+
+		// deadlines are kept in steady_clock, so wall clock steps do not move them, system_clock deadlines
+		// are converted at insert time; the thread sleeps in a timerfd armed to the earliest deadline
+		bool steady = false;
+
+		// there is no internal thread, fd() has to be polled for reading and process() called when it is
+		// readable, callbacks are invoked from process(); implies @steady
+		bool external = false;
+
+		// expired callbacks are split into batches of at most @dispatch_batch callbacks, every batch is
+		// handed to @executor as a single task, or invoked in place if there is no executor;
+		// executor may run tasks in parallel, stop() waits for all tasks it has been given
+		executor_t executor;
+		size_t dispatch_batch = 256;
+	};
+
+	// lateness of a batch is the time between the earliest deadline in it and the moment it starts running
+	struct dispatch_stats {
+		uint64_t batches = 0;
+		uint64_t callbacks = 0;
+		std::chrono::nanoseconds lateness_sum{0};
+		std::chrono::nanoseconds lateness_max{0};
+		std::chrono::nanoseconds lateness_last{0};
+
+		// for every fired deadline, number of distinct deadlines coalesced into it by slack minus one
+		uint64_t wakeups_saved = 0;
+	};
+
+	expiration(backend_t backend = backend_map, std::chrono::nanoseconds resolution = std::chrono::milliseconds(1)) :
+		expiration(make_options(backend, resolution)) {
+	}
+
+	explicit expiration(const options &opt) :
+		m_steady(opt.steady || opt.external),
+		m_base(now()),
+		m_resolution(opt.resolution),
+		m_wheel(opt.backend == backend_wheel ? new timing_wheel() : nullptr),
+		m_executor(opt.executor),
+		m_dispatch_batch(opt.dispatch_batch ? opt.dispatch_batch : 1) {
+		if (m_steady) {
+			m_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+			if (m_timerfd < 0) {
+				std::ostringstream ss;
+				ss << "failed to create expiration timerfd: " << strerror(errno);
+				throw std::runtime_error(ss.str());
+			}
+		}
+
+		if (!opt.external)
+			m_thread = std::thread(std::bind(&expiration::run, this));
 	}
 
 	~expiration() {
 		stop();
-		m_thread.join();
+		if (m_thread.joinable())
+			m_thread.join();
+		if (m_timerfd >= 0)
+			close(m_timerfd);
 	}
 
 	void stop() {
+		std::unique_lock<std::mutex> guard(m_lock);
 		m_need_exit = true;
-		m_wait.notify_one();
 
-		std::unique_lock<std::mutex> guard(m_lock);
-		m_wait.wait(guard, [&] () {return m_completed == true;});
+		if (m_thread.joinable()) {
+			if (m_timerfd >= 0)
+				arm(stamp_t(1));
+			else
+				m_wait.notify_one();
+
+			m_wait.wait(guard, [&] () {return m_completed == true;});
+		}
+
+		m_wait.wait(guard, [&] () {return m_dispatching == 0;});
 
 		m_timeouts.clear();
 		m_tok2time.clear();
+		if (m_wheel)
+			m_wheel.reset(new timing_wheel());
+		if (m_timerfd >= 0)
+			arm(stamp_t::max());
+	}
+
+	// timerfd which becomes readable when the earliest timer expires, -1 unless steady clock is used
+	int fd() const {
+		return m_timerfd;
 	}
 
-	token_t insert(const std::chrono::system_clock::time_point &expires_at, callback_t callback) {
+	// fires expired timers and rearms timerfd to the next deadline, called by the user
+	// when fd() is readable in external mode
+	void process() {
+		uint64_t expirations;
+		if (read(m_timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+			LOG(ERROR) << "ribosome::expiration::process: failed to read timerfd: " << strerror(errno);
+		}
+
 		std::unique_lock<std::mutex> guard(m_lock);
 
-		control_t ctl;
-		ctl.token = ++m_seq;
-		ctl.callback = callback;
+		expired_t expired;
+		collect_expired(&expired);
+		arm(next_deadline());
 
-		auto it = m_timeouts.find(expires_at);
-		if (it == m_timeouts.end()) {
-			m_timeouts.insert(std::make_pair(expires_at, std::vector<control_t>({ctl})));
+		dispatch(guard, expired);
+	}
 
-			if (VLOG_IS_ON(2)) {
-				char buf[128];
-				VLOG(2) << "ribosome::expiration::insert" <<
-					": expires_at: " << print_time(expires_at, buf, sizeof(buf)) <<
-					", token: " << ctl.token <<
-					", callback: " << ctl.callback.target_type().name() <<
-					", pushed new timeouts vector";
-			}
-		} else {
-			it->second.push_back(ctl);
+	dispatch_stats stats() const {
+		dispatch_stats st;
+		st.batches = m_stat_batches;
+		st.callbacks = m_stat_callbacks;
+		st.lateness_sum = std::chrono::nanoseconds(m_stat_lateness_sum);
+		st.lateness_max = std::chrono::nanoseconds(m_stat_lateness_max);
+		st.lateness_last = std::chrono::nanoseconds(m_stat_lateness_last);
+		st.wakeups_saved = m_stat_wakeups_saved;
+		return st;
+	}
 
-			if (VLOG_IS_ON(2)) {
-				char buf[128];
-				VLOG(2) << "ribosome::expiration::insert" <<
-					": expires_at: " << print_time(expires_at, buf, sizeof(buf)) <<
-					", token: " << ctl.token <<
-					", callback: " << ctl.callback.target_type().name() <<
-					", timeouts vector size: " << it->second.size();
-			}
-		}
+	// timer fires at some point within [@expires_at, @expires_at + @slack], deadlines within slack
+	// of each other are coalesced and fired in one wakeup
+	token_t insert(const std::chrono::system_clock::time_point &expires_at, callback_t callback,
+			std::chrono::nanoseconds slack = std::chrono::nanoseconds(0)) {
+		if (!m_steady)
+			return insert_stamp(std::chrono::duration_cast<stamp_t>(expires_at.time_since_epoch()), callback, slack);
 
-		m_tok2time[ctl.token] = expires_at;
+		return insert_stamp(now() + std::chrono::duration_cast<stamp_t>(expires_at - std::chrono::system_clock::now()),
+				callback, slack);
+	}
 
-		guard.unlock();
-		m_wait.notify_one();
+	token_t insert(const std::chrono::steady_clock::time_point &expires_at, callback_t callback,
+			std::chrono::nanoseconds slack = std::chrono::nanoseconds(0)) {
+		if (m_steady)
+			return insert_stamp(std::chrono::duration_cast<stamp_t>(expires_at.time_since_epoch()), callback, slack);
 
-		return ctl.token;
+		return insert_stamp(now() + std::chrono::duration_cast<stamp_t>(expires_at - std::chrono::steady_clock::now()),
+				callback, slack);
 	}
 
 	callback_t remove(const token_t token) {
 		std::unique_lock<std::mutex> guard(m_lock);
 
+		if (m_wheel) {
+			auto callback = m_wheel->remove(token);
+
+			VLOG(2) << "ribosome::expiration::remove" <<
+				": token: " << token <<
+				", callback: " << callback.operator bool() <<
+				", wheel size: " << m_wheel->size();
+			return callback;
+		}
+
 		auto etime = m_tok2time.find(token);
 		if (etime == m_tok2time.end()) {
 			VLOG(2) << "ribosome::expiration::remove" <<
@@ -113,7 +224,7 @@ public:
 			if (VLOG_IS_ON(2)) {
 				char buf[128];
 				VLOG(2) << "ribosome::expiration::remove" <<
-					": expires_at: " << print_time(expires_at, buf, sizeof(buf)) <<
+					": expires_at: " << print_time(system_time(expires_at), buf, sizeof(buf)) <<
 					", token: " << token <<
 					", there are no callbacks in timeouts map";
 			}
@@ -128,7 +239,7 @@ public:
 				if (VLOG_IS_ON(2)) {
 					char buf[128];
 					VLOG(2) << "ribosome::expiration::remove" <<
-						": expires_at: " << print_time(expires_at, buf, sizeof(buf)) <<
+						": expires_at: " << print_time(system_time(expires_at), buf, sizeof(buf)) <<
 						", token: " << token <<
 						", callback: " << callback.operator bool() <<
 						", timeouts vector size: " << ctl->second.size();
@@ -146,8 +257,11 @@ public:
 	}
 
 private:
+	// time since the epoch of the clock expiration runs on
+	typedef std::chrono::nanoseconds stamp_t;
+
 	token_t m_seq = 0;
-	bool m_need_exit = false;
+	std::atomic_bool m_need_exit{false};
 	bool m_completed = false;
 	std::condition_variable m_wait;
 	std::mutex m_lock;
@@ -155,52 +269,336 @@ private:
 	typedef struct {
 		token_t	token;
 		callback_t	callback;
+		// deadline timer has been inserted with, it is shifted within slack to the deadline of its bucket
+		stamp_t	requested;
 	} control_t;
 
+	struct expired_t {
+		std::vector<callback_t> callbacks;
+		std::vector<stamp_t> deadlines;
+	};
+
+	struct batch_t {
+		std::vector<callback_t> callbacks;
+		stamp_t deadline;
+	};
+
 	expiration(const expiration &other) = delete;
 
-	std::map<std::chrono::system_clock::time_point, std::vector<control_t>> m_timeouts;
-	std::unordered_map<token_t, std::chrono::system_clock::time_point> m_tok2time;
+	bool m_steady;
+
+	std::map<stamp_t, std::vector<control_t>> m_timeouts;
+	std::unordered_map<token_t, stamp_t> m_tok2time;
+
+	// wheel tick 0 starts at @m_base, every tick lasts @m_resolution
+	stamp_t m_base;
+	stamp_t m_resolution;
+	std::unique_ptr<timing_wheel> m_wheel;
+
+	// time the expiration thread sleeps until, insert() does not wake it up for later timeouts
+	stamp_t m_next_check = stamp_t::min();
+
+	// steady clock timerfd and its current absolute expiration time, stamp_t::max() when disarmed
+	int m_timerfd = -1;
+	stamp_t m_armed = stamp_t::max();
+
+	executor_t m_executor;
+	size_t m_dispatch_batch;
+	// number of batches handed to executor which have not completed yet, protected by @m_lock
+	int m_dispatching = 0;
+
+	std::atomic<uint64_t> m_stat_batches{0};
+	std::atomic<uint64_t> m_stat_callbacks{0};
+	std::atomic<int64_t> m_stat_lateness_sum{0};
+	std::atomic<int64_t> m_stat_lateness_max{0};
+	std::atomic<int64_t> m_stat_lateness_last{0};
+	std::atomic<uint64_t> m_stat_wakeups_saved{0};
 
 	std::thread m_thread;
 
-	void run() {
-		while (!m_need_exit) {
-			std::unique_lock<std::mutex> guard(m_lock);
+	static options make_options(backend_t backend, std::chrono::nanoseconds resolution) {
+		options opt;
+		opt.backend = backend;
+		opt.resolution = resolution;
+		return opt;
+	}
+
+	stamp_t now() const {
+		if (m_steady)
+			return std::chrono::duration_cast<stamp_t>(std::chrono::steady_clock::now().time_since_epoch());
+
+		return std::chrono::duration_cast<stamp_t>(std::chrono::system_clock::now().time_since_epoch());
+	}
 
-			std::chrono::system_clock::time_point next_check = std::chrono::system_clock::now() + std::chrono::seconds(1);
-			if (m_timeouts.size()) {
-				next_check = m_timeouts.begin()->first;
+	// only used for logging
+	std::chrono::system_clock::time_point system_time(stamp_t stamp) const {
+		auto ret = std::chrono::system_clock::now();
+		if (m_steady)
+			return ret + std::chrono::duration_cast<std::chrono::system_clock::duration>(stamp - now());
+
+		return std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(stamp));
+	}
+
+	// timer must not fire earlier than requested, so its tick is rounded up
+	uint64_t to_tick(stamp_t stamp) const {
+		if (stamp <= m_base)
+			return 0;
+
+		return (stamp - m_base + m_resolution - stamp_t(1)) / m_resolution;
+	}
+
+	uint64_t now_tick() const {
+		auto stamp = now();
+		if (stamp <= m_base)
+			return 0;
+
+		return (stamp - m_base) / m_resolution;
+	}
+
+	token_t insert_stamp(stamp_t expires_at, const callback_t &callback, stamp_t slack) {
+		std::unique_lock<std::mutex> guard(m_lock);
+
+		if (m_wheel) {
+			uint64_t slack_ticks = slack > stamp_t(0) ? slack / m_resolution : 0;
+			uint64_t tick = to_tick(expires_at);
+			token_t token = m_wheel->insert(tick, callback, slack_ticks);
+
+			if (VLOG_IS_ON(2)) {
+				char buf[128];
+				VLOG(2) << "ribosome::expiration::insert" <<
+					": expires_at: " << print_time(system_time(expires_at), buf, sizeof(buf)) <<
+					", token: " << token <<
+					", callback: " << callback.target_type().name() <<
+					", wheel size: " << m_wheel->size();
 			}
 
-			m_wait.wait_until(guard, next_check);
+			return notify(guard, m_base + m_resolution * (int64_t)timing_wheel::align(tick, slack_ticks), token);
+		}
 
-			std::vector<control_t> expired;
+		control_t ctl;
+		ctl.token = ++m_seq;
+		ctl.callback = callback;
+		ctl.requested = expires_at;
 
-			// mutex is locked
-			while (m_timeouts.size() != 0) {
-				auto f = m_timeouts.begin();
-				auto timestamp = f->first;
-				if (std::chrono::system_clock::now() < timestamp)
-					break;
+		if (slack > stamp_t(0))
+			expires_at = coalesce(expires_at, slack);
 
-				for (auto &c: f->second) {
-					expired.emplace_back(c);
-				}
+		auto it = m_timeouts.find(expires_at);
+		if (it == m_timeouts.end()) {
+			m_timeouts.insert(std::make_pair(expires_at, std::vector<control_t>({ctl})));
+
+			if (VLOG_IS_ON(2)) {
+				char buf[128];
+				VLOG(2) << "ribosome::expiration::insert" <<
+					": expires_at: " << print_time(system_time(expires_at), buf, sizeof(buf)) <<
+					", token: " << ctl.token <<
+					", callback: " << ctl.callback.target_type().name() <<
+					", pushed new timeouts vector";
+			}
+		} else {
+			it->second.push_back(ctl);
 
-				m_timeouts.erase(f);
+			if (VLOG_IS_ON(2)) {
+				char buf[128];
+				VLOG(2) << "ribosome::expiration::insert" <<
+					": expires_at: " << print_time(system_time(expires_at), buf, sizeof(buf)) <<
+					", token: " << ctl.token <<
+					", callback: " << ctl.callback.target_type().name() <<
+					", timeouts vector size: " << it->second.size();
+			}
+		}
 
-				for (auto &ctl: expired) {
-					m_tok2time.erase(ctl.token);
-				}
+		m_tok2time[ctl.token] = expires_at;
+
+		return notify(guard, expires_at, ctl.token);
+	}
+
+	// mutex is locked
+	// returns an already pending deadline within slack if there is one, so that timer does not need
+	// its own map node and wakeup, otherwise rounds deadline up to the largest power of two nanoseconds
+	// not exceeding slack, so that later timers with similar slack can join it
+	stamp_t coalesce(stamp_t expires_at, stamp_t slack) const {
+		auto it = m_timeouts.lower_bound(expires_at);
+		if (it != m_timeouts.end() && it->first <= expires_at + slack)
+			return it->first;
+
+		int64_t align = 1LL << (63 - __builtin_clzll(slack.count()));
+		return stamp_t((expires_at.count() + align - 1) / align * align);
+	}
+
+	// mutex is locked, releases it
+	token_t notify(std::unique_lock<std::mutex> &guard, stamp_t expires_at, token_t token) {
+		if (m_timerfd >= 0) {
+			if (expires_at < m_armed)
+				arm(expires_at);
+			return token;
+		}
+
+		bool wakeup = expires_at < m_next_check;
+		guard.unlock();
+
+		if (wakeup)
+			m_wait.notify_one();
+		return token;
+	}
+
+	// mutex is locked
+	void arm(stamp_t expires_at) {
+		struct itimerspec its;
+		memset(&its, 0, sizeof(its));
+
+		if (expires_at != stamp_t::max()) {
+			// zero expiration time disarms timerfd
+			if (expires_at <= stamp_t(0))
+				expires_at = stamp_t(1);
+
+			its.it_value.tv_sec = expires_at.count() / 1000000000;
+			its.it_value.tv_nsec = expires_at.count() % 1000000000;
+		}
+
+		if (timerfd_settime(m_timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+			LOG(ERROR) << "ribosome::expiration::arm: failed to set timerfd: " << strerror(errno);
+			return;
+		}
+
+		m_armed = expires_at;
+	}
+
+	// mutex is locked, returns stamp_t::max() if there are no timers
+	stamp_t next_deadline() const {
+		if (m_wheel) {
+			uint64_t tick = m_wheel->next_tick();
+			if (tick == timing_wheel::never)
+				return stamp_t::max();
+
+			return m_base + m_resolution * (int64_t)tick;
+		}
+
+		if (m_timeouts.empty())
+			return stamp_t::max();
+
+		return m_timeouts.begin()->first;
+	}
+
+	// mutex is locked
+	void collect_expired(expired_t *expired) {
+		if (m_wheel) {
+			std::vector<uint64_t> ticks;
+			m_wheel->advance(now_tick(), &expired->callbacks, &ticks);
+			m_stat_wakeups_saved = m_wheel->coalesced();
+
+			for (auto tick: ticks) {
+				expired->deadlines.push_back(m_base + m_resolution * (int64_t)tick);
+			}
+			return;
+		}
+
+		stamp_t stamp = now();
+		while (m_timeouts.size() != 0) {
+			auto f = m_timeouts.begin();
+			if (stamp < f->first)
+				break;
+
+			std::vector<stamp_t> requested;
+			for (auto &ctl: f->second) {
+				m_tok2time.erase(ctl.token);
+				expired->callbacks.emplace_back(std::move(ctl.callback));
+				expired->deadlines.push_back(f->first);
+				requested.push_back(ctl.requested);
+			}
+
+			if (requested.size() > 1) {
+				std::sort(requested.begin(), requested.end());
+				m_stat_wakeups_saved += std::unique(requested.begin(), requested.end()) - requested.begin() - 1;
 			}
 
-			guard.unlock();
+			m_timeouts.erase(f);
+		}
+	}
+
+	// mutex is locked, releases it
+	void dispatch(std::unique_lock<std::mutex> &guard, expired_t &expired) {
+		size_t num = expired.callbacks.size();
+		if (m_executor)
+			m_dispatching += (num + m_dispatch_batch - 1) / m_dispatch_batch;
+		guard.unlock();
+
+		for (size_t pos = 0; pos < num; pos += m_dispatch_batch) {
+			auto batch = std::make_shared<batch_t>();
+			size_t end = std::min(num, pos + m_dispatch_batch);
+
+			batch->deadline = *std::min_element(expired.deadlines.begin() + pos, expired.deadlines.begin() + end);
+			batch->callbacks.assign(std::make_move_iterator(expired.callbacks.begin() + pos),
+					std::make_move_iterator(expired.callbacks.begin() + end));
 
-			for (auto &ctl: expired) {
-				ctl.callback();
+			if (!m_executor) {
+				run_batch(*batch);
+				continue;
 			}
+
+			m_executor([this, batch] () {
+					run_batch(*batch);
+
+					std::lock_guard<std::mutex> guard(m_lock);
+					if (--m_dispatching == 0)
+						m_wait.notify_all();
+				});
 		}
+	}
+
+	void run_batch(batch_t &batch) {
+		int64_t lateness = std::max<int64_t>((now() - batch.deadline).count(), 0);
+
+		m_stat_batches++;
+		m_stat_callbacks += batch.callbacks.size();
+		m_stat_lateness_sum += lateness;
+		m_stat_lateness_last = lateness;
+
+		int64_t max = m_stat_lateness_max.load();
+		while (lateness > max && !m_stat_lateness_max.compare_exchange_weak(max, lateness));
+
+		for (auto &callback: batch.callbacks) {
+			callback();
+		}
+	}
+
+	void run_cv() {
+		while (!m_need_exit) {
+			std::unique_lock<std::mutex> guard(m_lock);
+
+			m_next_check = std::min(next_deadline(), now() + std::chrono::seconds(1));
+			m_wait.wait_until(guard, std::chrono::system_clock::time_point(
+						std::chrono::duration_cast<std::chrono::system_clock::duration>(m_next_check)));
+			m_next_check = stamp_t::min();
+
+			expired_t expired;
+			collect_expired(&expired);
+
+			dispatch(guard, expired);
+		}
+	}
+
+	void run_timerfd() {
+		struct pollfd pfd;
+		pfd.fd = m_timerfd;
+		pfd.events = POLLIN;
+
+		while (!m_need_exit) {
+			int err = poll(&pfd, 1, -1);
+			if (err < 0 && errno != EINTR) {
+				LOG(ERROR) << "ribosome::expiration::run: failed to poll timerfd: " << strerror(errno);
+				break;
+			}
+
+			process();
+		}
+	}
+
+	void run() {
+		if (m_timerfd >= 0)
+			run_timerfd();
+		else
+			run_cv();
 
 		std::unique_lock<std::mutex> guard(m_lock);
 		m_completed = true;
@@ -1,16 +1,37 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <sstream>
-#include <deque>
 #include <stdexcept>
+#include <string>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+#define RIBOSOME_FPOOL_COROUTINES
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <sched.h>
 #include <sys/epoll.h>
+#include <unistd.h>
+
+namespace ioremap { namespace ribosome {
 
-namespace ioremap { namespace ribosome { namespace fpool {
+class expiration;
+
+namespace fpool {
 
 template <typename T>
 class array_deleter {
@@ -20,34 +41,209 @@ public:
 	}
 };
 
+// Move-only message payload.
+// Buffers up to @max_pooled_size bytes are taken from power-of-two size classes cached per thread,
+// released buffer goes back to the cache of the thread which has allocated it: directly when it is released
+// by the same thread, or through the lock-free return list of that thread otherwise, so that buffers
+// of requests completed by the IO loop are reused by the producer threads.
+// Neither allocation nor atomic reference counting is needed when messages are passed between queues
+// and completions.
+// Buffer can also reference memory owned by someone else, like shared memory ring region,
+// in this case it holds a reference to the owner.
+class buffer {
+public:
+	static const size_t min_pooled_size = 64;
+	static const size_t max_pooled_size = 256 * 1024;
+
+	buffer() {
+	}
+	explicit buffer(size_t size);
+	explicit buffer(const std::shared_ptr<char> &owner) : m_ptr(owner.get()), m_owner(owner) {
+	}
+
+	buffer(buffer &&other) : m_ptr(other.m_ptr), m_class(other.m_class), m_home(other.m_home),
+			m_owner(std::move(other.m_owner)) {
+		other.m_ptr = NULL;
+		other.m_class = -1;
+		other.m_home = NULL;
+	}
+
+	buffer &operator =(buffer &&other) {
+		if (this != &other) {
+			reset();
+			std::swap(m_ptr, other.m_ptr);
+			std::swap(m_class, other.m_class);
+			std::swap(m_home, other.m_home);
+			m_owner = std::move(other.m_owner);
+		}
+		return *this;
+	}
+
+	buffer(const buffer &) = delete;
+	buffer &operator =(const buffer &) = delete;
+
+	~buffer() {
+		reset();
+	}
+
+	char *get() const {
+		return m_ptr;
+	}
+
+	explicit operator bool() const {
+		return m_ptr != NULL;
+	}
+
+	void reset();
+
+	// return list of the allocating thread
+	struct home;
+
+private:
+	char *m_ptr = NULL;
+	// size class of pooled buffer, -1 means buffer is not owned by the pool
+	int m_class = -1;
+	home *m_home = NULL;
+	std::shared_ptr<char> m_owner;
+};
+
+// Move-only owner of the file descriptor, descriptor is closed in destructor.
+class descriptor {
+public:
+	descriptor() {
+	}
+	explicit descriptor(int fd) : m_fd(fd) {
+	}
+
+	descriptor(descriptor &&other) : m_fd(other.release()) {
+	}
+
+	descriptor &operator =(descriptor &&other) {
+		if (this != &other)
+			reset(other.release());
+		return *this;
+	}
+
+	descriptor(const descriptor &) = delete;
+	descriptor &operator =(const descriptor &) = delete;
+
+	~descriptor() {
+		reset();
+	}
+
+	int get() const {
+		return m_fd;
+	}
+
+	explicit operator bool() const {
+		return m_fd >= 0;
+	}
+
+	int release() {
+		int fd = m_fd;
+		m_fd = -1;
+		return fd;
+	}
+
+	void reset(int fd = -1) {
+		if (m_fd >= 0)
+			::close(m_fd);
+		m_fd = fd;
+	}
+
+private:
+	int m_fd = -1;
+};
+
 struct message {
 	enum {
 		serialize_version_1 = 1,
 	};
 
-	struct {
+	// transport flags live in the upper bits of @header.flags and are never seen by callbacks
+	// payload has been placed into shared memory ring at @header.offset, only header is sent over the socket
+	static const uint64_t flag_shm = 1ULL << 63;
+	// payload is a sequence of packed messages, each one is header followed by its data
+	static const uint64_t flag_batch = 1ULL << 62;
+	// payload is a region of the file at @header.offset, descriptor is passed with SCM_RIGHTS
+	// and only header is sent over the socket, receiver maps the region
+	static const uint64_t flag_fd = 1ULL << 61;
+	// message is a part of the streaming request or reply with the same @header.id,
+	// streaming request starts with its head and ends with an empty chunk marked with @flag_stream_end,
+	// streaming reply is a sequence of chunks ended by the final reply marked with @flag_stream_end
+	static const uint64_t flag_stream = 1ULL << 60;
+	static const uint64_t flag_stream_end = 1ULL << 59;
+	static const uint64_t transport_flags_mask = flag_shm | flag_batch | flag_fd | flag_stream | flag_stream_end;
+
+	// priority class is stored in @header.flags and is passed to the worker unchanged,
+	// 0 is the default and the lowest priority, @priorities - 1 is the highest one
+	static const int priorities = 4;
+	static const int priority_shift = 56;
+	static const uint64_t priority_mask = (uint64_t)(priorities - 1) << priority_shift;
+
+	struct header_t {
 		uint64_t size = 0;
 		uint64_t flags = 0;
 		uint64_t id = 0;
+		// transport data, position of the payload in the shared memory ring
+		uint64_t offset = 0;
 		int status = 0;
 		int cmd = 0;
 	} header;
 
 	static const size_t header_size = sizeof(header);
 
-	std::shared_ptr<char> data;
+	// messages are move-only, use clone() to copy payload
+	buffer data;
+	// file which contains payload of the received message, or the one which will be passed to the other side
+	descriptor fd;
 	size_t io_offset = 0;
 
 	message() {
 	}
-	message(uint64_t size) {
+	message(uint64_t size) : data(size) {
 		header.size = size;
-		data = std::shared_ptr<char>(new char[size], array_deleter<char>());
 	}
 
+	message(message &&other) = default;
+	message &operator =(message &&other) = default;
+
 	~message() {
 	}
 
+	message clone() const {
+		if (header.flags & flag_fd) {
+			message ret;
+			ret.header = header;
+			ret.fd = descriptor(dup(fd.get()));
+			return ret;
+		}
+
+		message ret(header.size);
+		ret.header = header;
+		if (header.size)
+			memcpy(ret.data.get(), data.get(), header.size);
+		return ret;
+	}
+
+	// Creates message which payload is @size bytes of the file at @offset.
+	// Only descriptor is passed to the other side, which maps the region, payload is never copied.
+	// Message takes ownership of @fd, region is not mapped on the sender side.
+	static message from_fd(int fd, uint64_t offset, uint64_t size);
+
+	// Creates message backed by anonymous memory file of @size bytes,
+	// payload is mapped and can be filled before message is sent, throws on error.
+	static message memfd(uint64_t size);
+
+	int priority() const {
+		return (header.flags & priority_mask) >> priority_shift;
+	}
+
+	void set_priority(int prio) {
+		header.flags &= ~priority_mask;
+		header.flags |= ((uint64_t)prio << priority_shift) & priority_mask;
+	}
+
 	static message copy_header(const message &other) {
 		message ret;
 		ret.header = other.header;
@@ -59,6 +255,73 @@ struct message {
 		return io_offset == header_size + header.size;
 	}
 
+	// packs messages into a single batch message, payloads are copied once,
+	// descriptor is not packed, payload of such messages has to be mapped,
+	// otherwise it is packed as an empty one
+	static message pack(const std::vector<message> &msgs) {
+		auto payload_size = [] (const message &m) -> uint64_t {
+			return m.data.get() ? m.header.size : 0;
+		};
+
+		uint64_t size = 0;
+		for (auto &m: msgs) {
+			size += header_size + payload_size(m);
+		}
+
+		message ret(size);
+		ret.header.flags = flag_batch;
+
+		char *ptr = ret.data.get();
+		for (auto &m: msgs) {
+			uint64_t msize = payload_size(m);
+
+			message hdr = copy_header(m);
+			hdr.header.size = msize;
+			hdr.header.flags &= ~transport_flags_mask;
+			hdr.header.offset = 0;
+
+			memcpy(ptr, &hdr.header, header_size);
+			ptr += header_size;
+			if (msize) {
+				memcpy(ptr, m.data.get(), msize);
+				ptr += msize;
+			}
+		}
+
+		return ret;
+	}
+
+	// unpacks batch message, every payload is copied into its own buffer,
+	// batches are meant for small messages, where this is cheaper than sharing batch payload
+	static int unpack(const message &batch, std::vector<message> *msgs) {
+		if (!(batch.header.flags & flag_batch))
+			return -EPROTO;
+
+		uint64_t offset = 0;
+		while (offset < batch.header.size) {
+			if (batch.header.size - offset < header_size)
+				return -EPROTO;
+
+			header_t hdr;
+			memcpy(&hdr, batch.data.get() + offset, header_size);
+			offset += header_size;
+
+			if (batch.header.size - offset < hdr.size)
+				return -EPROTO;
+
+			message m(hdr.size);
+			m.header = hdr;
+			if (hdr.size)
+				memcpy(m.data.get(), batch.data.get() + offset, hdr.size);
+			m.io_offset = header_size + hdr.size;
+			offset += hdr.size;
+
+			msgs->emplace_back(std::move(m));
+		}
+
+		return 0;
+	}
+
 	std::string str() const {
 		std::ostringstream ss;
 		ss << "cmd: " << header.cmd <<
@@ -68,81 +331,861 @@ struct message {
 	}
 };
 
-class io_scheduler {
+struct options {
+	// number of worker processes
+	int workers = 1;
+
+	enum affinity_policy {
+		affinity_none = 0,
+		// every IO loop thread is pinned to a single CPU, worker processes it feeds are pinned
+		// to all allowed CPUs of its NUMA node, so that several workers of one loop do not share a CPU
+		affinity_cpu,
+		// IO loop threads and their workers are pinned to all allowed CPUs of the NUMA node
+		affinity_numa_node,
+	};
+	affinity_policy affinity = affinity_none;
+	// IO loop N is pinned to @affinity_cpus[N % size] (or to its NUMA node), when empty, loops are
+	// spread round-robin over CPUs (or NUMA nodes) which the controller process is allowed to run on
+	std::vector<int> affinity_cpus;
+
+	// elastic pool: @workers processes are started, then their number is changed between
+	// @min_workers and @max_workers depending on load, zero @max_workers disables resizing
+	int min_workers = 1;
+	int max_workers = 0;
+	// new worker is started when a request has waited in queue longer than this, milliseconds
+	long scale_up_wait = 10;
+	// new worker is not started while 1-minute load average per online CPU exceeds this, 0 disables the check
+	double scale_up_max_load = 0;
+	// worker which has had no requests for this long is stopped, milliseconds
+	long scale_down_idle = 10000;
+	// load is checked this often, at most one worker is started or stopped per check, milliseconds
+	long scale_interval = 100;
+
+	// maximum number of requests sent to a single worker whose replies have not yet been received,
+	// replies are matched to requests by @message::header.id, which is replaced on the wire
+	// with worker-local sequence number and restored before completion is called
+	// 1 means strict request-reply mode, when next message is sent only after the previous one has been answered
+	size_t max_in_flight = 1;
+
+	// size of the shared memory ring created for each direction between controller and every worker,
+	// payloads which fit into the ring are copied there and consumed in place by the other side,
+	// only header crosses the socket, larger payloads and those which do not fit are sent inline
+	// 0 disables shared memory transport
+	size_t shm_ring_size = 0;
+
+	// number of event loop threads which multiplex all worker sockets, workers are assigned round-robin,
+	// 0 means every worker gets its own event loop thread
+	int io_threads = 0;
+
+	enum dispatch_policy {
+		// message is queued to the worker with the smallest number of queued and in-flight messages
+		dispatch_least_outstanding = 0,
+		// message is queued to the worker with the smallest number of queued and in-flight payload bytes
+		dispatch_least_bytes,
+		// messages are put into a single queue, workers pull from it when they have free pipeline slots
+		dispatch_shared_queue,
+	};
+	dispatch_policy dispatch = dispatch_least_outstanding;
+
+	// request scheduled with a deadline, which is still in flight this long after the deadline,
+	// is considered stuck, its worker is killed and restarted, milliseconds
+	long kill_timeout = 1000;
+
+	// when worker process terminates, its queued requests are dispatched again among all workers
+	// instead of waiting for the replacement process
+	bool redispatch_on_failure = false;
+
+	// workers are forked by a small zygote process which is forked when controller is created,
+	// so respawn time does not depend on the size of the controller process
+	bool prefork = false;
+
+	// number of started spare worker processes, crashed worker is replaced with one of them
+	// and the standby pool is refilled afterwards
+	size_t standby = 0;
+
+	// admission limits on pending requests, i.e. queued and in-flight ones, and their payload bytes,
+	// request which does not fit is rejected with -EAGAIN, 0 means there is no limit,
+	// single request larger than bytes limit is only accepted when nothing is pending
+	// per worker limits, not used in @dispatch_shared_queue mode
+	size_t worker_queue_limit = 0;
+	uint64_t worker_queue_bytes_limit = 0;
+	// limits for the whole pool
+	size_t queue_limit = 0;
+	uint64_t queue_bytes_limit = 0;
+
+	enum priority_policy {
+		// queued request of the highest priority is always sent first
+		priority_strict = 0,
+		// non-empty priority classes are served in turn starting from the highest one,
+		// class gets up to @priority_weights[class] requests in a row, lower classes are never starved
+		priority_weighted,
+	};
+	priority_policy priority = priority_strict;
+	int priority_weights[message::priorities] = {1, 2, 4, 8};
+};
+
+struct priority_stats {
+	// requests of this priority class waiting in queues
+	uint64_t queued = 0;
+	// completed requests and time from scheduling until completion, microseconds
+	uint64_t completed = 0;
+	uint64_t total_usec = 0;
+	uint64_t max_usec = 0;
+};
+
+struct admission_stats {
+	// requests which have been refused because queue limits have been reached
+	uint64_t rejected = 0;
+	uint64_t rejected_bytes = 0;
+	// controller::schedule_wait() calls which had to wait for free space and those which have timed out
+	uint64_t waited = 0;
+	uint64_t timed_out = 0;
+};
+
+struct respawn_stats {
+	// number of workers replaced after their processes have terminated
+	uint64_t respawns = 0;
+	// number of replacements which have taken a standby process
+	uint64_t standby_used = 0;
+
+	// time from process termination detection until replacement is attached, microseconds
+	uint64_t last_usec = 0;
+	uint64_t max_usec = 0;
+	uint64_t total_usec = 0;
+};
+
+// Log-linear histogram of non-negative integer values: every power of two range is split
+// into @sub_buckets equal buckets, so relative error of returned values is below 1 / @sub_buckets.
+class histogram {
 public:
-	io_scheduler(int efd, int fd, uint32_t event);
-	~io_scheduler();
+	static const int sub_bucket_bits = 4;
+	static const int sub_buckets = 1 << sub_bucket_bits;
+	static const int buckets = 2 * sub_buckets + (63 - sub_bucket_bits) * sub_buckets;
 
-	int ready(long timeout_ms, epoll_event *ev);
+	static int bucket(uint64_t value);
+	// the largest value which falls into @bucket
+	static uint64_t bucket_max(int bucket);
+
+	histogram();
+	// restores histogram from bucket counts and exact sum and maximum of recorded values
+	histogram(const std::vector<uint64_t> &counts, uint64_t sum, uint64_t max);
+
+	void record(uint64_t value, uint64_t count = 1);
+	void merge(const histogram &other);
+
+	uint64_t count() const;
+	uint64_t sum() const;
+	uint64_t max() const;
+	double mean() const;
+	// the smallest bucket bound which is not less than @percentile percent of recorded values
+	uint64_t percentile(double percentile) const;
+
+	const std::vector<uint64_t> &counts() const;
 
 private:
-	int m_efd;
-	int m_fd;
-	uint32_t m_event;
+	std::vector<uint64_t> m_counts;
+	uint64_t m_count = 0;
+	uint64_t m_sum = 0;
+	uint64_t m_max = 0;
+};
+
+struct worker_metrics {
+	pid_t pid = -1;
+
+	// microseconds from scheduling until request has been taken by the IO loop
+	histogram queue_wait;
+	// microseconds from being taken by the IO loop until completion
+	histogram service;
+	// microseconds from scheduling until completion
+	histogram latency;
+
+	// requests taken by the IO loop and replies received, payload bytes
+	uint64_t requests = 0;
+	uint64_t request_bytes = 0;
+	uint64_t replies = 0;
+	uint64_t reply_bytes = 0;
+
+	// requests waiting in the worker queue and requests sent to the process but not completed yet
+	uint64_t queued = 0;
+	uint64_t in_flight = 0;
+
+	// requests dropped from the queue or completed after their deadline,
+	// counted when the IO loop takes or completes them
+	uint64_t timeouts = 0;
+	// number of times process of this worker has been replaced
+	uint64_t restarts = 0;
+};
+
+struct metrics_snapshot {
+	std::vector<worker_metrics> workers;
+	// sum of all workers including those which have been removed from the pool
+	worker_metrics total;
+};
+
+// Single producer, single consumer byte ring in shared memory file.
+// It is mapped before fork() or attached by descriptor, one process allocates regions and the other one releases them.
+// Regions are released in arbitrary order, but freed space is only returned to producer in order.
+class shm_ring : public std::enable_shared_from_this<shm_ring> {
+public:
+	shm_ring();
+	~shm_ring();
+
+	int map(size_t size);
+	// maps ring created by another process, takes ownership of @fd
+	int attach(int fd, size_t size);
+
+	int fd() const;
+
+	// faults in data pages from the calling thread, so that they are allocated on its NUMA node
+	void prefault();
+
+	// producer side: allocates region and copies @size bytes of @data there,
+	// returns false if there is no free space in the ring
+	bool push(const char *data, size_t size, uint64_t *pos);
+
+	// consumer side: returns pointer to the region at @pos, region is released
+	// when the last copy of the returned pointer is destroyed
+	std::shared_ptr<char> pop(uint64_t pos, size_t size);
+
+private:
+	struct control {
+		// position up to which consumer has released the ring
+		std::atomic<uint64_t> tail;
+	};
+
+	struct region {
+		uint64_t pos;
+		uint64_t size;
+		bool released;
+	};
+
+	descriptor m_fd;
+	char *m_map = NULL;
+	size_t m_map_size = 0;
+
+	control *m_ctl = NULL;
+	char *m_data = NULL;
+	size_t m_size = 0;
+
+	// producer side
+	uint64_t m_head = 0;
+
+	// consumer side, regions in order of their positions
+	std::mutex m_lock;
+	std::deque<region> m_regions;
+
+	int map_fd(size_t size);
+	void release(uint64_t pos);
+};
+
+// Worker process which has been started, but is not attached to the worker object yet.
+struct spawned {
+	pid_t pid = -1;
+	// parent side of the worker socket
+	descriptor fd;
+	std::shared_ptr<shm_ring> tx_ring;
+	std::shared_ptr<shm_ring> rx_ring;
+};
+
+class worker;
+class stream;
+
+// Event loop thread which drives IO of the parent side of multiple workers.
+// Worker sockets are registered in a single epoll instance in edge-triggered mode,
+// workers with newly queued messages are put into ready list and loop is woken up via eventfd
+// only if it sleeps in epoll_wait().
+class io_loop {
+public:
+	io_loop();
+	~io_loop();
+
+	// loop thread is pinned to @cpus and processes of its workers to @worker_cpus if they are not NULL
+	int start(const cpu_set_t *cpus = NULL, const cpu_set_t *worker_cpus = NULL);
+	void stop();
+
+	// returns false if workers of this loop are not pinned
+	bool worker_cpus(cpu_set_t *cpus) const;
+
+	int add(worker *w);
+	// when this function returns, loop does not access worker anymore
+	void remove(worker *w);
+
+	// called when new message has been queued into worker
+	void schedule(worker *w);
+
+private:
+	int m_epollfd = -1;
+	int m_wakefd = -1;
+	std::atomic_bool m_need_exit{false};
+
+	// set when loop is about to sleep in epoll_wait(), only then schedule() has to wake it up
+	std::atomic_bool m_sleeping;
+
+	bool m_pinned = false;
+	cpu_set_t m_cpus;
+	bool m_workers_pinned = false;
+	cpu_set_t m_worker_cpus;
+
+	std::mutex m_ready_lock;
+	std::vector<worker *> m_ready;
+
+	// held while events are processed, protects registered workers
+	std::mutex m_io_lock;
+	std::unordered_set<worker *> m_workers;
+
+	std::thread m_thread;
+
+	void run();
+	void process(worker *w);
 };
 
 class worker {
 public:
 	typedef std::function<message (const message &)> callback_t;
-	typedef std::function<void (const message &)> completion_t;
+	// reply is destroyed when completion returns, completion can move it out instead of copying
+	typedef std::function<void (message &)> completion_t;
+
+	// processes batch of messages in a forked child, must return one reply per request in the same order
+	typedef std::function<std::vector<message> (const std::vector<message> &)> batch_callback_t;
+	typedef std::function<void (const std::vector<message> &)> batch_completion_t;
+
+	// streaming request: fills @chunk with the next request chunk and returns 0, returns 1 when there are
+	// no more chunks, negative error ends the stream and is passed to the worker as status of the last chunk
+	typedef std::function<int (message *chunk)> stream_source_t;
+	// runs in a forked child for streaming requests, reads request chunks and writes reply chunks via @s,
+	// returns the final reply
+	typedef std::function<message (const message &head, stream &s)> stream_callback_t;
+
+	struct stream_handlers {
+		stream_source_t source;
+		// called for every reply chunk except the final reply
+		completion_t chunk;
+	};
+
+	typedef std::chrono::system_clock::time_point deadline_t;
 
-	worker();
+	// message queued to the worker or to the shared queue
+	struct job {
+		job(message &&m, completion_t c, deadline_t d = deadline_t())
+			: msg(std::move(m)), complete(std::move(c)), deadline(d)
+			, queued_at(std::chrono::steady_clock::now()) {
+		}
+
+		message msg;
+		completion_t complete;
+		// default value means there is no deadline
+		deadline_t deadline;
+		std::chrono::steady_clock::time_point queued_at;
+		// set for streaming requests
+		std::shared_ptr<stream_handlers> stream;
+	};
+
+	// jobs split by priority class, dequeued according to @options::priority policy
+	class job_queue {
+	public:
+		void configure(const options &opt);
+
+		void push(job &&j);
+		// queue must not be empty
+		job pop();
+
+		bool empty() const {
+			return m_size == 0;
+		}
+		size_t size() const {
+			return m_size;
+		}
+		size_t size(int prio) const {
+			return m_queues[prio].size();
+		}
+
+		// moves out all jobs, the highest priority first
+		void take(std::deque<job> *jobs);
+
+	private:
+		std::deque<job> m_queues[message::priorities];
+		size_t m_size = 0;
+
+		options::priority_policy m_policy = options::priority_strict;
+		int m_weights[message::priorities];
+		// weighted policy: class being served and number of requests it can still send in a row
+		int m_class = 0;
+		int m_credit = 0;
+
+		int next_class();
+	};
+
+	// queue shared by all workers in @options::dispatch_shared_queue mode
+	struct shared_queue {
+		std::mutex lock;
+		job_queue queue;
+		uint64_t bytes = 0;
+	};
+
+	// callers blocked in controller::schedule_wait() are woken up when requests are completed
+	struct admission {
+		admission() : waiters(0) {
+		}
+
+		std::mutex lock;
+		std::condition_variable cv;
+		std::atomic_int waiters;
+
+		void notify() {
+			if (waiters.load()) {
+				std::unique_lock<std::mutex> guard(lock);
+				guard.unlock();
+				cv.notify_all();
+			}
+		}
+	};
+
+	worker(io_loop *loop, const options &opt = options(), shared_queue *shared = NULL, admission *adm = NULL);
 	~worker();
 
-	int start(callback_t callback);
-	int restart(callback_t callback);
+	int start(callback_t callback, batch_callback_t batch_callback = batch_callback_t(),
+			stream_callback_t stream_callback = stream_callback_t());
+	// attaches process started by fork_process() or zygote
+	int start(spawned &&sp);
+	int restart(callback_t callback, batch_callback_t batch_callback = batch_callback_t(),
+			stream_callback_t stream_callback = stream_callback_t());
 	int stop(int *status);
+	// sends SIGTERM and detaches worker from its process without waiting for it, the caller reaps it
+	int terminate();
 
 	void close();
 
 	pid_t pid() const;
+	io_loop *loop() const;
 
+	// these counters are updated atomically and can be read without locks
+	// number of messages queued to this worker, but not yet taken by the IO loop
 	size_t queue_size() const;
-	void queue(const message &msg, completion_t complete);
+	// number of messages which are being sent or wait for reply
+	size_t in_flight() const;
+	// payload bytes of queued and in-flight messages
+	uint64_t outstanding_bytes() const;
+	// adds counters of every priority class to @stats
+	void priority_counters(std::vector<priority_stats> *stats) const;
+	void metrics(worker_metrics *m) const;
+	// returns the longest time a request has waited in queue since the previous call, microseconds
+	uint64_t take_queue_wait();
+	// time when the last request has been sent or completed
+	std::chrono::steady_clock::time_point last_active() const;
+
+	// worker which is going to be stopped does not pull requests from the shared queue,
+	// @drained is called by the IO loop when its last request in flight has been completed
+	void retire(std::function<void ()> drained);
+
+	void queue(message &&msg, completion_t complete);
+	void queue(job &&j);
+	// moves out messages which have not yet been taken by the IO loop
+	void take_queue(std::deque<job> *queue);
+
+	// asks IO loop to check requests which have been sent, but have not been answered after their deadline
+	void check_deadlines();
+
+	// asks IO loop to pull messages from the shared queue if there are free pipeline slots
+	void notify();
+
+	// forks new worker process, it is not attached to any worker object
+	static int fork_process(const options &opt, callback_t callback, batch_callback_t batch_callback,
+			stream_callback_t stream_callback, spawned *sp);
 
 private:
+	friend class io_loop;
+	friend class zygote;
+	friend class stream;
+
+	options m_opt;
+	io_loop *m_loop;
+	shared_queue *m_shared;
+	admission *m_admission;
+
 	int m_fd = -1;
+	// child only, parent socket is registered in @m_loop
 	int m_epollfd = -1;
-	pid_t m_pid = -1;
-	bool m_need_exit = false;
+	// reassigned by the wait thread on restart while IO loop reads it
+	std::atomic<pid_t> m_pid{-1};
+	std::atomic_bool m_need_exit{false};
+
+	// @m_fd is registered in epoll once for the whole worker lifetime in edge-triggered mode,
+	// these flags are set when epoll reports readiness and cleared when IO returns EAGAIN
+	bool m_readable = false;
+	bool m_writable = false;
+	bool m_hup = false;
+
+	// parent only: set when process has been pinned, shared memory is faulted in by the IO loop thread
+	bool m_prefault = false;
+
+	// parent only: set when IO has failed, worker does not process events until restarted
+	int m_io_error = 0;
+	// parent only: set when worker is in io_loop ready list
+	std::atomic_bool m_scheduled;
+	// parent only: set while worker is registered in its io_loop, protected by io_loop ready list lock,
+	// worker which is not registered is never put into the ready list
+	bool m_attached = false;
 
 	std::mutex m_lock;
-	std::condition_variable m_wait;
-	std::deque<std::pair<message, completion_t>> m_queue;
+	job_queue m_queue;
+
+	std::atomic<size_t> m_queued;
+	std::atomic<size_t> m_in_flight_count;
+	std::atomic<uint64_t> m_outstanding_bytes;
+	std::atomic<uint64_t> m_queue_wait;
+	// steady clock ticks
+	std::atomic<int64_t> m_last_active;
+	std::atomic_bool m_retired;
+	// set before @m_retired
+	std::function<void ()> m_drained;
+
+	struct priority_counters_t {
+		std::atomic<uint64_t> queued;
+		std::atomic<uint64_t> completed;
+		std::atomic<uint64_t> total_usec;
+		std::atomic<uint64_t> max_usec;
+	};
+	priority_counters_t m_priority[message::priorities];
 
-	std::unique_ptr<std::thread> m_io_thread;
+	// written by the IO loop thread only, read by metrics()
+	struct atomic_histogram {
+		std::atomic<uint64_t> counts[histogram::buckets];
+		std::atomic<uint64_t> sum;
+		std::atomic<uint64_t> max;
 
-	ssize_t read_raw(char *ptr, size_t size);
-	ssize_t write_raw(const char *ptr, size_t size);
+		atomic_histogram();
+		void record(uint64_t value);
+		void load(histogram *h) const;
+	};
+	atomic_histogram m_queue_wait_hist;
+	atomic_histogram m_service_hist;
+	atomic_histogram m_latency_hist;
+
+	std::atomic<uint64_t> m_requests;
+	std::atomic<uint64_t> m_request_bytes;
+	std::atomic<uint64_t> m_replies;
+	std::atomic<uint64_t> m_reply_bytes;
+	std::atomic<uint64_t> m_timeouts;
+	std::atomic<uint64_t> m_starts;
+
+	struct request {
+		// message being sent, its header.id is replaced with wire id
+		message msg;
+		// original request header, data is not copied
+		message hdr;
+		uint64_t size;
+		// empty when request has been completed before reply has been received
+		completion_t complete;
+		deadline_t deadline;
+		std::chrono::steady_clock::time_point queued_at;
+		std::chrono::steady_clock::time_point sent_at;
+
+		// streaming request stays at the front of @m_sending until its last chunk has been written,
+		// @msg holds the chunk being written
+		std::shared_ptr<stream_handlers> stream;
+		// head has been written
+		bool started = false;
+		bool last_chunk = false;
+		// final reply has been received before the last chunk has been written
+		bool replied = false;
+	};
+
+	// set when deadlines of sent requests have to be checked by the IO loop
+	std::atomic_bool m_check_deadlines;
+
+	// IO loop only: messages taken from @m_queue, front one is being written
+	std::deque<request> m_sending;
+	// IO loop only: requests which have been sent and wait for reply, indexed by wire id
+	std::unordered_map<uint64_t, request> m_in_flight;
+	uint64_t m_seq = 0;
+	// IO loop only: partially read reply
+	message m_reply;
+
+	// shared memory rings, created before process is started
+	std::shared_ptr<shm_ring> m_tx_ring;
+	std::shared_ptr<shm_ring> m_rx_ring;
 
-	int write(message &msg, long timeout);
-	int read(message &msg, long timeout);
+	static int create_rings(const options &opt, spawned *sp);
+
+	// maximum number of iovecs in a single sendmsg(), every message takes up to 2 of them
+	static const int max_write_iov = 64;
+	// socket data is received into this buffer until message header is known,
+	// small messages are received whole, and several of them can be received by a single syscall
+	static const size_t rx_buffer_size = 64 * 1024;
+
+	std::unique_ptr<char[]> m_rx_buf;
+	size_t m_rx_start = 0;
+	size_t m_rx_end = 0;
+
+	// descriptors received with SCM_RIGHTS in order of their messages
+	static const int max_rx_fds = 16;
+	std::deque<descriptor> m_rx_fds;
+
+	// nonblocking vectored IO
+	// sends header and payload of as many messages as possible with a single sendmsg(),
+	// returns -EAGAIN if socket is full before all of them have been sent
+	int write_some(message **msgs, size_t num);
+	void prepare_write(message &msg);
+
+	// returns number of bytes received or negative error, message is not completed only when socket is empty
+	ssize_t read_some(message &msg);
+	int consume_buffered(message &msg);
 
 	// runs in a forked child
-	void run(callback_t callback);
+	void run_child(int fd, callback_t callback, batch_callback_t batch_callback, stream_callback_t stream_callback);
+	void run(callback_t callback, batch_callback_t batch_callback, stream_callback_t stream_callback);
+	message process(const message &req, callback_t &callback, batch_callback_t &batch_callback);
+	int wait_events(long timeout);
+	// sends as many replies as possible, returns -EAGAIN if socket is full
+	int write_replies(std::deque<message> &replies);
+	// blocking IO used by streaming requests
+	int read_message(message &msg);
+	int flush_replies(std::deque<message> &replies);
+
+	// runs in the IO loop
+	void set_events(uint32_t events);
+	int io_step();
+	void io_failed(int err);
+	bool fill_pipeline();
+	void push_request(job &j);
+	void next_chunk(request &req);
+	int expire_sent();
+	void complete_request(request &req, message &reply);
+	int complete_reply(message &reply);
+	void fail_pending(int err);
+};
+
+// Child side of the streaming request, passed to @worker::stream_callback_t.
+// Request chunks are read from the socket only when they are asked for and reply chunks are written
+// before write() returns, so memory usage is bounded by the chunk size and socket buffers.
+class stream {
+public:
+	// returns 0 and the next request chunk, 1 when request has ended, or negative error sent by the controller
+	int read(message *chunk);
+	// sends reply chunk, blocks until it has been written into the socket
+	void write(message &&chunk);
+
+private:
+	friend class worker;
+
+	worker *m_worker;
+	uint64_t m_id;
+	// requests which have been read ahead, partially read message and replies being written
+	std::deque<message> *m_pending;
+	message *m_msg;
+	std::deque<message> *m_replies;
+	bool m_ended = false;
+
+	stream(worker *w, uint64_t id, std::deque<message> *pending, message *msg, std::deque<message> *replies);
+};
+
+// Small helper process forked before worker processes, it holds a copy of the callbacks
+// and forks new workers on request. Workers are created with CLONE_PARENT, so they are
+// children of the controller process and are reaped by it.
+// Worker socket and shared memory rings are created by controller and passed with SCM_RIGHTS.
+class zygote {
+public:
+	zygote(const options &opt);
+	~zygote();
+
+	int start(worker::callback_t callback, worker::batch_callback_t batch_callback,
+			worker::stream_callback_t stream_callback);
+	int spawn(spawned *sp);
+
+	pid_t pid() const;
+
+private:
+	options m_opt;
+	pid_t m_pid = -1;
+	int m_fd = -1;
+	std::mutex m_lock;
 
-	// runs in the IO thread
-	int raw_io();
-	void io();
+	void run(worker::callback_t callback, worker::batch_callback_t batch_callback,
+			worker::stream_callback_t stream_callback);
 };
 
 class controller {
 public:
 	controller(int size, worker::callback_t callback);
+	controller(const options &opt, worker::callback_t callback,
+			worker::batch_callback_t batch_callback = worker::batch_callback_t(),
+			worker::stream_callback_t stream_callback = worker::stream_callback_t());
 	~controller();
 
+	void schedule(message &&msg, worker::completion_t complete);
+	// request which has not been sent to worker by @deadline is completed with -ETIMEDOUT,
+	// request which has been sent is completed with -ETIMEDOUT and its reply is dropped,
+	// if reply has not been received @options::kill_timeout after the deadline, worker is restarted
+	void schedule(message &&msg, worker::deadline_t deadline, worker::completion_t complete);
+
+	// streaming request: @head is sent first, then chunks returned by @source, which is called from the IO loop
+	// thread only after the previous chunk has been written, so it must not block, worker gets them via
+	// @worker::stream_callback_t, reply chunks are passed to @chunk and the final reply to @complete
+	void schedule_stream(message &&head, worker::stream_source_t source,
+			worker::completion_t chunk, worker::completion_t complete);
+
+	// returned future gets the reply, its payload is moved out of the pool without copying,
+	// reply payload received via shared memory ring holds ring space until the message is destroyed
+	std::future<message> schedule(message &&msg);
+	std::future<message> schedule(message &&msg, worker::deadline_t deadline);
+
+#ifdef RIBOSOME_FPOOL_COROUTINES
+	// co_await ctl.async(std::move(msg)) suspends the coroutine until the reply is received,
+	// coroutine is resumed by the thread which completes the request, usually the IO loop thread,
+	// request completed within schedule(), e.g. rejected one, does not suspend the coroutine at all,
+	// nothing is allocated besides the messages
+	class awaitable {
+	public:
+		awaitable(controller &ctl, message &&msg) : m_ctl(ctl), m_msg(std::move(msg)) {
+		}
+
+		bool await_ready() const noexcept {
+			return false;
+		}
+
+		// whichever of completion and await_suspend comes last continues the coroutine:
+		// completion resumes it, await_suspend returns false
+		bool await_suspend(std::coroutine_handle<> handle) {
+			m_ctl.schedule(std::move(m_msg), [this, handle] (message &reply) {
+						m_reply = std::move(reply);
+						if (m_state.exchange(state_completed) == state_suspended)
+							handle.resume();
+					});
+
+			int expected = state_pending;
+			return m_state.compare_exchange_strong(expected, state_suspended);
+		}
+
+		message await_resume() {
+			return std::move(m_reply);
+		}
+
+	private:
+		controller &m_ctl;
+		message m_msg;
+		message m_reply;
+
+		enum {
+			state_pending = 0,
+			state_suspended,
+			state_completed,
+		};
+		std::atomic<int> m_state = {state_pending};
+	};
+
+	awaitable async(message &&msg) {
+		return awaitable(*this, std::move(msg));
+	}
+#endif
+
+	// these functions return error instead of calling completion if request has not been accepted,
+	// @msg is left intact in this case
+	// returns -EAGAIN if queue limits have been reached
+	int try_schedule(message &&msg, worker::completion_t complete);
+	// waits up to @timeout milliseconds for free space in queues, returns -ETIMEDOUT if there is none
+	int schedule_wait(message &&msg, worker::completion_t complete, long timeout);
+
+	admission_stats admission() const;
+
+	// one entry per priority class
+	std::vector<priority_stats> priorities();
+
+	metrics_snapshot metrics();
+	// payload is copied, prefer moving message into the pool
 	void schedule(const message &msg, worker::completion_t complete);
 
+	// sends all messages to a single worker as one batch, completion is called once with replies
+	// in the same order, if batch has failed, every reply is a copy of request header with error status
+	void schedule(const std::vector<message> &msgs, worker::batch_completion_t complete);
+
+	// safe to call while the pool is being resized
 	std::vector<pid_t> pids() const;
 
+	respawn_stats respawns();
+
 private:
-	std::mutex m_lock;
+	options m_opt;
+
+	// started before workers, so that they are forked from the small process
+	std::unique_ptr<zygote> m_zygote;
+
+	// loops must outlive workers
+	std::vector<std::unique_ptr<io_loop>> m_loops;
+
+	// must outlive workers
+	worker::shared_queue m_shared_queue;
+	worker::admission m_admission;
+
+	std::atomic<uint64_t> m_rejected;
+	std::atomic<uint64_t> m_rejected_bytes;
+	std::atomic<uint64_t> m_waited;
+	std::atomic<uint64_t> m_timed_out;
+
+	mutable std::mutex m_lock;
+	// modified under @m_lock only by the constructor and the wait thread,
+	// so the wait thread can read it without the lock
 	std::vector<std::unique_ptr<worker>> m_workers;
+	// counters of workers which have been removed from the pool, protected by @m_lock
+	worker_metrics m_removed;
+	// steady timing wheel, created when the first request with a deadline is scheduled
+	std::unique_ptr<ribosome::expiration> m_expiration;
 	worker::callback_t m_callback;
+	worker::batch_callback_t m_batch_callback;
+	worker::stream_callback_t m_stream_callback;
 
-	bool m_wait_need_exit = false;
+	std::mutex m_standby_lock;
+	std::deque<spawned> m_standby;
+	respawn_stats m_respawn;
+
+	// termination of every owned process is detected via its pidfd registered in this epoll,
+	// processes whose pidfd could not be opened are polled, other children are never reaped
+	int m_wait_epollfd = -1;
+	int m_wait_wakefd = -1;
+	std::mutex m_watch_lock;
+	std::unordered_map<pid_t, descriptor> m_watched;
+	size_t m_polled = 0;
+
+	// SIGKILL timers of removed workers, run by the wait thread when their timerfd is readable
+	std::unique_ptr<ribosome::expiration> m_stop_timers;
+	// processes which have been sent SIGTERM and have not been reaped yet with their timer tokens,
+	// wait thread only
+	std::unordered_map<pid_t, uint64_t> m_stopping;
+
+	std::atomic<bool> m_wait_need_exit{false};
 	std::thread m_wait_thread;
 
+	// wait thread only
+	std::chrono::steady_clock::time_point m_next_resize;
+
+	// retired workers waiting for their requests in flight to complete, wait thread only
+	struct retiring_worker {
+		std::unique_ptr<worker> w;
+		std::chrono::steady_clock::time_point deadline;
+	};
+	std::vector<retiring_worker> m_retiring;
+
+	void watch(pid_t pid);
+	void unwatch(pid_t pid);
+	void reap(pid_t pid, int status);
+	void check_deadlines();
+	// job is moved into the queue only if it has been accepted
+	int dispatch(worker::job &j, bool limited);
+	void redispatch(worker::job &j);
+	bool over_limit(size_t pending, uint64_t bytes, uint64_t size, size_t limit, uint64_t bytes_limit) const;
+	void reject(const message &msg);
+
+	int spawn(spawned *sp);
+	void fill_standby();
+	int add_worker();
+	// starts or stops one worker if the pool is elastic and load requires it
+	void resize();
+	void remove_worker(std::unique_ptr<worker> &&w);
+	// removes retired workers which have completed their requests or have not done it in time,
+	// returns milliseconds until the closest retire deadline, -1 if there are no retiring workers
+	long remove_retired();
+	void wake_wait_thread();
+	bool take_standby(spawned *sp);
+	bool drop_standby(pid_t pid);
 	void wait_for_children();
 };
 
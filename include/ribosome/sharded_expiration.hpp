@@ -0,0 +1,389 @@
+#ifndef __RIBOSOME_SHARDED_EXPIRATION_HPP
+#define __RIBOSOME_SHARDED_EXPIRATION_HPP
+
+#include "ribosome/expiration.hpp"
+#include "ribosome/timing_wheel.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <new>
+
+#include <sched.h>
+
+namespace ioremap { namespace ribosome {
+
+// Expiration service with the same insert/remove API as @expiration, split into shards with own
+// timing wheel and thread each. insert() picks the shard of the current CPU, takes a timer entry from
+// the shard's lock-free free list and pushes it into the shard's lock-free insert queue, remove() claims
+// the callback with a single CAS on the entry state and queues entry for unlinking. Only the shard thread
+// links, unlinks and fires timers, so producers never wait for expiration scans or for each other.
+class sharded_expiration {
+public:
+	typedef expiration::callback_t callback_t;
+	typedef expiration::token_t token_t;
+
+	static const int max_shards = 256;
+
+	// @shards == 0 means one shard per CPU
+	sharded_expiration(int shards = 0,
+			std::chrono::system_clock::duration resolution = std::chrono::milliseconds(1)) {
+		if (shards <= 0)
+			shards = std::thread::hardware_concurrency();
+		if (shards <= 0)
+			shards = 1;
+		if (shards > max_shards)
+			shards = max_shards;
+
+		auto base = std::chrono::system_clock::now();
+		for (int i = 0; i < shards; ++i) {
+			m_shards.emplace_back(new shard(i, base, resolution));
+		}
+	}
+
+	~sharded_expiration() {
+		stop();
+	}
+
+	void stop() {
+		for (auto &s: m_shards) {
+			s->stop();
+		}
+	}
+
+	// see expiration::insert() for @slack
+	token_t insert(const std::chrono::system_clock::time_point &expires_at, callback_t callback,
+			std::chrono::nanoseconds slack = std::chrono::nanoseconds(0)) {
+		int cpu = sched_getcpu();
+		if (cpu < 0)
+			cpu = 0;
+
+		return m_shards[cpu % m_shards.size()]->insert(expires_at, std::move(callback), slack);
+	}
+
+	callback_t remove(const token_t token) {
+		size_t idx = token >> shard_shift;
+		if (idx >= m_shards.size())
+			return callback_t();
+
+		return m_shards[idx]->remove(token);
+	}
+
+private:
+	// token: 8 bits of shard index, 30 bits of entry generation, 26 bits of entry index,
+	// stale token matches a reused entry only after 2^30 reuses of that entry
+	static const int shard_shift = 56;
+	static const int gen_shift = 26;
+	static const uint64_t index_mask = (1ULL << gen_shift) - 1;
+	static const uint32_t gen_mask = (1U << (shard_shift - gen_shift)) - 1;
+
+	class shard {
+	public:
+		shard(int index, const std::chrono::system_clock::time_point &base,
+				std::chrono::system_clock::duration resolution) :
+			m_index(index), m_base(base), m_resolution(resolution),
+			m_thread(std::bind(&shard::run, this)) {
+		}
+
+		~shard() {
+			stop();
+
+			for (auto &c: m_chunks) {
+				delete[] c.load();
+			}
+		}
+
+		void stop() {
+			std::unique_lock<std::mutex> guard(m_lock);
+			m_need_exit = true;
+			guard.unlock();
+			m_wait.notify_one();
+
+			if (m_thread.joinable())
+				m_thread.join();
+		}
+
+		token_t insert(const std::chrono::system_clock::time_point &expires_at, callback_t &&callback,
+				std::chrono::nanoseconds slack) {
+			uint32_t idx = alloc();
+			entry &e = at(idx);
+
+			uint32_t gen = e.state.load(std::memory_order_relaxed) >> state_bits;
+			uint64_t tick = to_tick(expires_at);
+			e.callback = std::move(callback);
+			e.tick = tick;
+			e.slack = slack > std::chrono::nanoseconds(0) ? slack / m_resolution : 0;
+			e.state.store(make_state(gen, state_pending), std::memory_order_release);
+
+			// entry can be fired and reused as soon as it is pushed, it must not be touched anymore
+			push(&m_inserts, idx, &entry::insert_next);
+
+			if (tick < m_sleep_until.load()) {
+				std::lock_guard<std::mutex> guard(m_lock);
+				m_wait.notify_one();
+			}
+
+			return ((token_t)m_index << shard_shift) | ((token_t)(gen & gen_mask) << gen_shift) | idx;
+		}
+
+		callback_t remove(token_t token) {
+			uint32_t idx = token & index_mask;
+			entry *e = find(idx);
+			if (!e)
+				return callback_t();
+
+			uint64_t state = e->state.load(std::memory_order_acquire);
+			uint32_t gen = state >> state_bits;
+			if ((gen & gen_mask) != ((token >> gen_shift) & gen_mask) || (state & state_mask) != state_pending)
+				return callback_t();
+
+			if (!e->state.compare_exchange_strong(state, make_state(gen, state_claimed)))
+				return callback_t();
+
+			callback_t callback;
+			callback.swap(e->callback);
+			push(&m_removes, idx, &entry::remove_next);
+
+			return callback;
+		}
+
+	private:
+		static const int state_bits = 2;
+		static const uint64_t state_mask = (1 << state_bits) - 1;
+		static const uint64_t state_free = 0;
+		static const uint64_t state_pending = 1;
+		// callback has been taken either by remove() or by the shard thread which is going to fire it
+		static const uint64_t state_claimed = 2;
+
+		static const uint32_t nil = std::numeric_limits<uint32_t>::max();
+		static const int chunk_bits = 12;
+		static const uint32_t chunk_size = 1 << chunk_bits;
+		static const int max_chunks = 1 << 14;
+
+		static_assert((uint64_t)max_chunks * chunk_size <= index_mask + 1, "entry index does not fit into token");
+
+		struct entry {
+			callback_t callback;
+			// generation << state_bits | state, generation is incremented every time entry is freed
+			std::atomic<uint64_t> state{0};
+			uint64_t tick = 0;
+			uint64_t slack = 0;
+
+			std::atomic<uint32_t> free_next{nil};
+			uint32_t insert_next = nil;
+			uint32_t remove_next = nil;
+
+			// touched by the shard thread only, 0 when entry is not linked into the wheel
+			timing_wheel::token_t wheel_token = 0;
+		};
+
+		static uint64_t make_state(uint64_t gen, uint64_t state) {
+			return (gen << state_bits) | state;
+		}
+
+		int m_index;
+		std::chrono::system_clock::time_point m_base;
+		std::chrono::system_clock::duration m_resolution;
+
+		// entries are allocated in chunks which are never freed until shard is destroyed,
+		// so a stale token or a concurrent free list pop always reads valid memory
+		std::atomic<entry *> m_chunks[max_chunks] = {};
+		std::atomic<int> m_num_chunks{0};
+
+		// free list head: ABA tag << 32 | entry index
+		std::atomic<uint64_t> m_free{nil};
+		// intrusive MPSC stacks, the shard thread takes them whole
+		std::atomic<uint32_t> m_inserts{nil};
+		std::atomic<uint32_t> m_removes{nil};
+
+		// wheel tick the shard thread sleeps until, 0 while it runs,
+		// insert() only wakes the thread up for timers expiring earlier
+		std::atomic<uint64_t> m_sleep_until{0};
+
+		timing_wheel m_wheel;
+
+		bool m_need_exit = false;
+		std::mutex m_lock;
+		std::condition_variable m_wait;
+		std::thread m_thread;
+
+		entry &at(uint32_t idx) {
+			return m_chunks[idx >> chunk_bits].load(std::memory_order_acquire)[idx & (chunk_size - 1)];
+		}
+
+		entry *find(uint32_t idx) {
+			if ((idx >> chunk_bits) >= (uint32_t)max_chunks)
+				return NULL;
+
+			entry *chunk = m_chunks[idx >> chunk_bits].load(std::memory_order_acquire);
+			if (!chunk)
+				return NULL;
+
+			return &chunk[idx & (chunk_size - 1)];
+		}
+
+		uint64_t to_tick(const std::chrono::system_clock::time_point &tp) const {
+			if (tp <= m_base)
+				return 0;
+
+			return (tp - m_base + m_resolution - std::chrono::system_clock::duration(1)) / m_resolution;
+		}
+
+		uint64_t now_tick() const {
+			auto now = std::chrono::system_clock::now();
+			if (now <= m_base)
+				return 0;
+
+			return (now - m_base) / m_resolution;
+		}
+
+		uint32_t alloc() {
+			uint64_t head = m_free.load(std::memory_order_acquire);
+			while ((uint32_t)head != nil) {
+				uint32_t idx = head;
+				uint32_t next = at(idx).free_next.load(std::memory_order_relaxed);
+				uint64_t tagged = (((head >> 32) + 1) << 32) | next;
+
+				if (m_free.compare_exchange_weak(head, tagged, std::memory_order_acquire))
+					return idx;
+			}
+
+			int chunk_idx = m_num_chunks.fetch_add(1);
+			if (chunk_idx >= max_chunks)
+				throw std::bad_alloc();
+
+			entry *chunk = new entry[chunk_size];
+			m_chunks[chunk_idx].store(chunk, std::memory_order_release);
+
+			// the first entry is returned, the rest goes to the free list
+			uint32_t first = chunk_idx << chunk_bits;
+			for (uint32_t i = chunk_size - 1; i > 0; --i) {
+				release(first + i);
+			}
+
+			return first;
+		}
+
+		void release(uint32_t idx) {
+			entry &e = at(idx);
+
+			uint64_t head = m_free.load(std::memory_order_relaxed);
+			do {
+				e.free_next.store((uint32_t)head, std::memory_order_relaxed);
+			} while (!m_free.compare_exchange_weak(head, (((head >> 32) + 1) << 32) | idx,
+						std::memory_order_release, std::memory_order_relaxed));
+		}
+
+		void free(uint32_t idx) {
+			entry &e = at(idx);
+			e.wheel_token = 0;
+
+			uint64_t gen = (e.state.load(std::memory_order_relaxed) >> state_bits) + 1;
+			e.state.store(make_state(gen, state_free), std::memory_order_relaxed);
+			release(idx);
+		}
+
+		void push(std::atomic<uint32_t> *stack, uint32_t idx, uint32_t entry::*next) {
+			entry &e = at(idx);
+
+			uint32_t head = stack->load(std::memory_order_relaxed);
+			do {
+				e.*next = head;
+			} while (!stack->compare_exchange_weak(head, idx, std::memory_order_seq_cst, std::memory_order_relaxed));
+		}
+
+		// returns stack entries in push order
+		std::vector<uint32_t> take(std::atomic<uint32_t> *stack, uint32_t entry::*next) {
+			std::vector<uint32_t> ret;
+			for (uint32_t idx = stack->exchange(nil, std::memory_order_acquire); idx != nil; idx = at(idx).*next) {
+				ret.push_back(idx);
+			}
+
+			std::reverse(ret.begin(), ret.end());
+			return ret;
+		}
+
+		// removes are taken before inserts, so that insert of every taken remove has already been taken too
+		void drain() {
+			std::vector<uint32_t> removes = take(&m_removes, &entry::remove_next);
+			std::vector<uint32_t> inserts = take(&m_inserts, &entry::insert_next);
+
+			for (auto idx: inserts) {
+				entry &e = at(idx);
+
+				// removed before it has been linked
+				if ((e.state.load(std::memory_order_acquire) & state_mask) != state_pending)
+					continue;
+
+				e.wheel_token = m_wheel.insert(e.tick, [this, idx] () {fire(idx);}, e.slack);
+			}
+
+			for (auto idx: removes) {
+				entry &e = at(idx);
+				if (e.wheel_token)
+					m_wheel.remove(e.wheel_token);
+
+				free(idx);
+			}
+		}
+
+		void fire(uint32_t idx) {
+			entry &e = at(idx);
+			e.wheel_token = 0;
+
+			uint64_t state = e.state.load(std::memory_order_acquire);
+			if ((state & state_mask) != state_pending ||
+					!e.state.compare_exchange_strong(state, make_state(state >> state_bits, state_claimed))) {
+				// remove() has won, entry is freed when its remove is drained
+				return;
+			}
+
+			callback_t callback;
+			callback.swap(e.callback);
+			free(idx);
+
+			callback();
+		}
+
+		void run() {
+			std::unique_lock<std::mutex> guard(m_lock);
+
+			while (!m_need_exit) {
+				m_sleep_until.store(0);
+				guard.unlock();
+
+				drain();
+
+				std::vector<timing_wheel::callback_t> expired;
+				m_wheel.advance(now_tick(), &expired);
+				for (auto &fire: expired) {
+					fire();
+				}
+
+				uint64_t next = m_wheel.next_tick();
+				std::chrono::system_clock::time_point next_check = std::chrono::system_clock::now() + std::chrono::seconds(1);
+				if (next != timing_wheel::never && m_base + m_resolution * (int64_t)next < next_check)
+					next_check = m_base + m_resolution * (int64_t)next;
+				else
+					next = to_tick(next_check);
+
+				guard.lock();
+				if (m_need_exit)
+					break;
+
+				// insert() which has not seen the new sleep time has already pushed its entry
+				m_sleep_until.store(next);
+				if (m_inserts.load() != nil)
+					continue;
+
+				m_wait.wait_until(guard, next_check);
+			}
+		}
+	};
+
+	std::vector<std::unique_ptr<shard>> m_shards;
+};
+
+}} // namespace ioremap::ribosome
+
+#endif // __RIBOSOME_SHARDED_EXPIRATION_HPP
@@ -0,0 +1,264 @@
+#ifndef __RIBOSOME_TIMING_WHEEL_HPP
+#define __RIBOSOME_TIMING_WHEEL_HPP
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <vector>
+
+#include <stdint.h>
+
+namespace ioremap { namespace ribosome {
+
+// Hierarchical timing wheel over abstract integer ticks, not thread-safe.
+// Level N has @slots slots, each one covers @slots^N ticks. Timer is put into the level of the highest
+// tick digit in which its expiration differs from the current tick, and is moved (cascaded) to lower levels
+// when the current tick reaches its slot, so insert and remove are O(1) and every timer is cascaded
+// at most @levels times. Timers live in a node array addressed by token, so there are no per-timer
+// allocations besides the callback itself once the array has grown.
+class timing_wheel {
+public:
+	typedef std::function<void ()> callback_t;
+	typedef uint64_t token_t;
+
+	static const int slot_bits = 6;
+	static const int slots = 1 << slot_bits;
+	static const int levels = 6;
+
+	static const uint64_t never = std::numeric_limits<uint64_t>::max();
+
+	explicit timing_wheel(uint64_t now = 0) : m_now(now) {
+		for (auto &h: m_heads)
+			h = nil;
+		for (auto &o: m_occupied)
+			o = 0;
+	}
+
+	// timer which expires at or before the current tick fires at the next advance(),
+	// timer may be delayed by up to @slack ticks to share its tick with other timers
+	token_t insert(uint64_t tick, const callback_t &callback, uint64_t slack = 0) {
+		uint32_t idx;
+		if (m_free.empty()) {
+			idx = m_nodes.size();
+			m_nodes.emplace_back();
+		} else {
+			idx = m_free.back();
+			m_free.pop_back();
+		}
+
+		node &n = m_nodes[idx];
+		n.requested = tick > m_now ? tick : m_now + 1;
+		n.tick = align(n.requested, slack);
+		n.callback = callback;
+		link(idx);
+
+		m_size++;
+		return ((token_t)n.gen << 32) | idx;
+	}
+
+	// returns empty callback if timer has already fired or has been removed
+	callback_t remove(token_t token) {
+		uint32_t idx = token;
+		if (idx >= m_nodes.size())
+			return callback_t();
+
+		node &n = m_nodes[idx];
+		if (n.slot < 0 || n.gen != (uint32_t)(token >> 32))
+			return callback_t();
+
+		unlink(idx);
+		callback_t callback;
+		callback.swap(n.callback);
+		release(idx);
+
+		m_size--;
+		return callback;
+	}
+
+	// rounds @tick up to the largest power of two not exceeding @slack,
+	// so that timers with similar slack land on the same tick
+	static uint64_t align(uint64_t tick, uint64_t slack) {
+		if (!slack)
+			return tick;
+
+		uint64_t align = 1ULL << (63 - __builtin_clzll(slack));
+		return (tick + align - 1) & ~(align - 1);
+	}
+
+	size_t size() const {
+		return m_size;
+	}
+
+	uint64_t now() const {
+		return m_now;
+	}
+
+	// number of wakeups saved by slack: for every fired tick, number of distinct requested ticks
+	// of its timers minus one
+	uint64_t coalesced() const {
+		return m_coalesced;
+	}
+
+	// returns the closest tick at which a timer expires or has to be cascaded, @never if there are no timers
+	uint64_t next_tick() const {
+		if (!m_size)
+			return never;
+
+		for (int l = 0; l < levels; ++l) {
+			int shift = l * slot_bits;
+			int cur = (m_now >> shift) & (slots - 1);
+
+			uint64_t mask = cur == slots - 1 ? 0 : m_occupied[l] & (~0ULL << (cur + 1));
+			if (mask) {
+				uint64_t rotation = (m_now >> (shift + slot_bits)) << (shift + slot_bits);
+				return rotation | ((uint64_t)__builtin_ctzll(mask) << shift);
+			}
+		}
+
+		// only timers beyond the range of the top level are left, they wrap into the next top level rotation
+		int shift = (levels - 1) * slot_bits;
+		uint64_t rotation = ((m_now >> (shift + slot_bits)) + 1) << (shift + slot_bits);
+		return rotation | ((uint64_t)__builtin_ctzll(m_occupied[levels - 1]) << shift);
+	}
+
+	// fires all timers which expire at or before @now, their callbacks are moved into @expired,
+	// and their expiration ticks are pushed into @ticks if it is not NULL
+	void advance(uint64_t now, std::vector<callback_t> *expired, std::vector<uint64_t> *ticks = NULL) {
+		while (true) {
+			uint64_t tick = next_tick();
+			if (tick > now) {
+				if (now > m_now)
+					m_now = now;
+				return;
+			}
+
+			m_now = tick;
+
+			// higher levels are cascaded first, they can refill lower level slots which are cascaded next
+			for (int l = levels - 1; l > 0; --l) {
+				int shift = l * slot_bits;
+				if (tick & ((1ULL << shift) - 1))
+					continue;
+
+				cascade(l, (tick >> shift) & (slots - 1));
+			}
+
+			int slot = tick & (slots - 1);
+			uint32_t idx = m_heads[slot];
+			m_heads[slot] = nil;
+			m_occupied[0] &= ~(1ULL << slot);
+
+			m_requested.clear();
+			while (idx != nil) {
+				node &n = m_nodes[idx];
+				uint32_t next = n.next;
+
+				m_requested.push_back(n.requested);
+
+				expired->emplace_back(std::move(n.callback));
+				if (ticks)
+					ticks->push_back(n.tick);
+				n.callback = callback_t();
+				n.slot = -1;
+				release(idx);
+				m_size--;
+
+				idx = next;
+			}
+
+			if (m_requested.size() > 1) {
+				std::sort(m_requested.begin(), m_requested.end());
+				m_coalesced += std::unique(m_requested.begin(), m_requested.end()) - m_requested.begin() - 1;
+			}
+		}
+	}
+
+private:
+	static const uint32_t nil = std::numeric_limits<uint32_t>::max();
+
+	struct node {
+		uint64_t tick = 0;
+		// tick timer has been inserted with, @tick is rounded up from it by slack
+		uint64_t requested = 0;
+		callback_t callback;
+		uint32_t prev = nil;
+		uint32_t next = nil;
+		// slot index in @m_heads, -1 when timer is not linked
+		int slot = -1;
+		// incremented when node is released, so that stale tokens do not match reused nodes
+		uint32_t gen = 1;
+	};
+
+	uint64_t m_now;
+	size_t m_size = 0;
+
+	uint64_t m_coalesced = 0;
+	std::vector<uint64_t> m_requested;
+
+	std::vector<node> m_nodes;
+	std::vector<uint32_t> m_free;
+
+	uint32_t m_heads[levels * slots];
+	// bit per non-empty slot
+	uint64_t m_occupied[levels];
+
+	void link(uint32_t idx) {
+		node &n = m_nodes[idx];
+
+		int level = 0;
+		uint64_t diff = n.tick ^ m_now;
+		if (diff)
+			level = (63 - __builtin_clzll(diff)) / slot_bits;
+		if (level >= levels)
+			level = levels - 1;
+
+		int pos = (n.tick >> (level * slot_bits)) & (slots - 1);
+		int slot = level * slots + pos;
+
+		n.slot = slot;
+		n.prev = nil;
+		n.next = m_heads[slot];
+		if (n.next != nil)
+			m_nodes[n.next].prev = idx;
+		m_heads[slot] = idx;
+		m_occupied[level] |= 1ULL << pos;
+	}
+
+	void unlink(uint32_t idx) {
+		node &n = m_nodes[idx];
+
+		if (n.prev != nil)
+			m_nodes[n.prev].next = n.next;
+		else
+			m_heads[n.slot] = n.next;
+		if (n.next != nil)
+			m_nodes[n.next].prev = n.prev;
+
+		if (m_heads[n.slot] == nil)
+			m_occupied[n.slot / slots] &= ~(1ULL << (n.slot % slots));
+
+		n.slot = -1;
+	}
+
+	void release(uint32_t idx) {
+		m_nodes[idx].gen++;
+		m_free.push_back(idx);
+	}
+
+	void cascade(int level, int pos) {
+		int slot = level * slots + pos;
+		uint32_t idx = m_heads[slot];
+		m_heads[slot] = nil;
+		m_occupied[level] &= ~(1ULL << pos);
+
+		while (idx != nil) {
+			uint32_t next = m_nodes[idx].next;
+			link(idx);
+			idx = next;
+		}
+	}
+};
+
+}} // namespace ioremap::ribosome
+
+#endif // __RIBOSOME_TIMING_WHEEL_HPP
@@ -1,13 +1,21 @@
 #include "ribosome/fpool.hpp"
-#include "ribosome/timer.hpp"
+#include "ribosome/expiration.hpp"
 
 #include <algorithm>
 #include <iomanip>
+#include <new>
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,92 +35,2220 @@ namespace ioremap { namespace ribosome {
 
 namespace fpool {
 
-io_scheduler::io_scheduler(int efd, int fd, uint32_t event) : m_efd(efd), m_fd(fd), m_event(event)
+const size_t message::header_size;
+const int message::priorities;
+const int message::priority_shift;
+const uint64_t message::priority_mask;
+
+// Buffers released by threads other than the allocating one are pushed into its home list and are moved
+// into its cache when the cache runs out of buffers. Homes are never freed: home of the exited thread
+// is closed, buffers released into it are deleted until the home is reused by a new thread.
+struct buffer::home {
+	std::atomic<uintptr_t> head{0};
+};
+
+namespace {
+
+// power-of-two size classes from buffer::min_pooled_size to buffer::max_pooled_size
+static const int buffer_min_shift = 6;
+static const int buffer_max_shift = 18;
+static const int buffer_classes = buffer_max_shift - buffer_min_shift + 1;
+// every size class caches up to this many bytes, but at least 2 buffers
+static const size_t buffer_cache_bytes = 512 * 1024;
+
+static_assert(buffer::min_pooled_size == 1UL << buffer_min_shift, "invalid minimum pooled buffer size");
+static_assert(buffer::max_pooled_size == 1UL << buffer_max_shift, "invalid maximum pooled buffer size");
+
+// released buffer in the home list, it is placed into the buffer memory itself
+struct buffer_node {
+	buffer_node *next;
+	int cls;
+};
+
+static_assert(sizeof(buffer_node) <= buffer::min_pooled_size, "buffer node does not fit into the smallest buffer");
+
+static const uintptr_t buffer_home_closed = 1;
+
+static std::mutex buffer_homes_lock;
+static std::vector<buffer::home *> buffer_free_homes;
+
+struct buffer_cache {
+	std::vector<char *> free[buffer_classes];
+	buffer::home *home;
+	bool alive = true;
+
+	buffer_cache() {
+		std::lock_guard<std::mutex> guard(buffer_homes_lock);
+		if (buffer_free_homes.empty()) {
+			home = new buffer::home;
+		} else {
+			home = buffer_free_homes.back();
+			buffer_free_homes.pop_back();
+			home->head.store(0);
+		}
+	}
+
+	~buffer_cache() {
+		alive = false;
+
+		release_list(home->head.exchange(buffer_home_closed, std::memory_order_acquire));
+		for (auto &f: free) {
+			for (auto ptr: f) {
+				delete [] ptr;
+			}
+		}
+
+		std::lock_guard<std::mutex> guard(buffer_homes_lock);
+		buffer_free_homes.push_back(home);
+	}
+
+	void put(int cls, char *ptr) {
+		auto &f = free[cls];
+		if (f.size() < class_limit(cls))
+			f.push_back(ptr);
+		else
+			delete [] ptr;
+	}
+
+	// moves buffers released by other threads into the cache
+	void drain() {
+		if (home->head.load(std::memory_order_relaxed) == 0)
+			return;
+
+		release_list(home->head.exchange(0, std::memory_order_acquire));
+	}
+
+	void release_list(uintptr_t head) {
+		buffer_node *node = (buffer_node *)head;
+		while (node) {
+			buffer_node *next = node->next;
+			int cls = node->cls;
+			char *ptr = (char *)node;
+
+			if (alive)
+				put(cls, ptr);
+			else
+				delete [] ptr;
+
+			node = next;
+		}
+	}
+
+	static size_t class_size(int cls) {
+		return 1UL << (cls + buffer_min_shift);
+	}
+
+	static size_t class_limit(int cls) {
+		return std::max(buffer_cache_bytes / class_size(cls), (size_t)2);
+	}
+};
+
+static thread_local buffer_cache tls_buffer_cache;
+
+static int buffer_class(size_t size)
+{
+	if (size > buffer::max_pooled_size)
+		return -1;
+
+	int cls = 0;
+	while (buffer_cache::class_size(cls) < size)
+		cls++;
+
+	return cls;
+}
+
+static void buffer_release_remote(buffer::home *home, int cls, char *ptr)
+{
+	buffer_node *node = new (ptr) buffer_node;
+	node->cls = cls;
+
+	uintptr_t head = home->head.load(std::memory_order_relaxed);
+	do {
+		if (head == buffer_home_closed) {
+			delete [] ptr;
+			return;
+		}
+
+		node->next = (buffer_node *)head;
+	} while (!home->head.compare_exchange_weak(head, (uintptr_t)node,
+				std::memory_order_release, std::memory_order_relaxed));
+}
+
+} // anonymous namespace
+
+buffer::buffer(size_t size)
+{
+	m_class = buffer_class(size);
+	if (m_class < 0) {
+		m_ptr = new char[size];
+		return;
+	}
+
+	auto &cache = tls_buffer_cache;
+	if (cache.alive) {
+		m_home = cache.home;
+
+		auto &f = cache.free[m_class];
+		if (f.empty())
+			cache.drain();
+		if (!f.empty()) {
+			m_ptr = f.back();
+			f.pop_back();
+			return;
+		}
+	}
+
+	m_ptr = new char[buffer_cache::class_size(m_class)];
+}
+
+void buffer::reset()
+{
+	if (m_owner) {
+		m_owner.reset();
+	} else if (m_ptr) {
+		if (m_class < 0 || !m_home)
+			delete [] m_ptr;
+		else if (tls_buffer_cache.alive && m_home == tls_buffer_cache.home)
+			tls_buffer_cache.put(m_class, m_ptr);
+		else
+			buffer_release_remote(m_home, m_class, m_ptr);
+	}
+
+	m_ptr = NULL;
+	m_class = -1;
+	m_home = NULL;
+}
+
+// Maps @size bytes of the file at @offset, mapping is private, so it can be created for read-only descriptors.
+static buffer map_region(int fd, uint64_t offset, uint64_t size, int prot, int flags, int *err)
+{
+	if (size == 0)
+		return buffer();
+
+	uint64_t page_size = sysconf(_SC_PAGESIZE);
+	uint64_t aligned = offset / page_size * page_size;
+	size_t delta = offset - aligned;
+	size_t map_size = size + delta;
+
+	void *ptr = mmap(NULL, map_size, prot, flags, fd, aligned);
+	if (ptr == MAP_FAILED) {
+		*err = -errno;
+		return buffer();
+	}
+
+	return buffer(std::shared_ptr<char>((char *)ptr + delta, [ptr, map_size] (char *) {
+				munmap(ptr, map_size);
+			}));
+}
+
+message message::from_fd(int fd, uint64_t offset, uint64_t size)
+{
+	message msg;
+	msg.fd = descriptor(fd);
+	msg.header.flags = flag_fd;
+	msg.header.offset = offset;
+	msg.header.size = size;
+	return msg;
+}
+
+message message::memfd(uint64_t size)
+{
+	int fd = memfd_create("fpool", MFD_CLOEXEC);
+	if (fd < 0) {
+		int err = -errno;
+		throw std::runtime_error("could not create memory file: " + std::string(strerror(-err)));
+	}
+
+	message msg = from_fd(fd, 0, size);
+
+	int err = 0;
+	if (ftruncate(fd, size) < 0)
+		err = -errno;
+	else
+		msg.data = map_region(fd, 0, size, PROT_READ | PROT_WRITE, MAP_SHARED, &err);
+
+	if (err)
+		throw std::runtime_error("could not map memory file: size: " + std::to_string(size) +
+				": " + std::string(strerror(-err)));
+
+	return msg;
+}
+
+static int epoll_add(int efd, int fd, uint32_t events, void *ptr)
 {
 	epoll_event ev;
-	ev.events = event;
-	ev.data.fd = m_fd;
-	int err = epoll_ctl(m_efd, EPOLL_CTL_ADD, m_fd, &ev);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = ptr;
+
+	int err = epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
 	if (err < 0) {
 		err = -errno;
+		LOG(ERROR) << "could not add epoll event: fd: " << fd <<
+			", error: " << strerror(-err) << " [" << err << "]";
+		return err;
+	}
+
+	return 0;
+}
+
+shm_ring::shm_ring()
+{
+}
+
+shm_ring::~shm_ring()
+{
+	if (m_map) {
+		munmap(m_map, m_map_size);
+	}
+}
+
+int shm_ring::map(size_t size)
+{
+	m_fd = descriptor(memfd_create("fpool-ring", MFD_CLOEXEC));
+	if (!m_fd) {
+		int err = -errno;
+		LOG(ERROR) << "fpool::shm_ring::map: could not create memory file" <<
+			": error: " << strerror(-err) << " [" << err << "]";
+		return err;
+	}
+
+	int err = map_fd(size);
+	if (err)
+		return err;
+
+	m_ctl = new (m_map) control();
+	m_ctl->tail.store(0);
+	return 0;
+}
+
+int shm_ring::attach(int fd, size_t size)
+{
+	m_fd = descriptor(fd);
+	return map_fd(size);
+}
+
+int shm_ring::fd() const
+{
+	return m_fd.get();
+}
+
+void shm_ring::prefault()
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+
+	// read fault of the shared mapping allocates the page, nothing is written to the live ring
+	for (size_t off = 0; off < m_size; off += page_size) {
+		volatile char c = m_data[off];
+		(void) c;
+	}
+}
+
+int shm_ring::map_fd(size_t size)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t ctl_size = page_size;
+
+	m_size = (size + page_size - 1) / page_size * page_size;
+	m_map_size = ctl_size + m_size;
+
+	int err = 0;
+	void *ptr = MAP_FAILED;
+	if (ftruncate(m_fd.get(), m_map_size) < 0)
+		err = -errno;
+	else
+		ptr = mmap(NULL, m_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd.get(), 0);
+
+	if (ptr == MAP_FAILED) {
+		if (!err)
+			err = -errno;
+		LOG(ERROR) << "fpool::shm_ring::map: could not map " << m_map_size << " bytes" <<
+			": error: " << strerror(-err) << " [" << err << "]";
+		m_map_size = 0;
+		return err;
+	}
+
+	m_map = (char *)ptr;
+	m_ctl = (control *)m_map;
+	m_data = m_map + ctl_size;
+
+	return 0;
+}
+
+static inline size_t shm_align(size_t size)
+{
+	return (size + 63) & ~63ULL;
+}
+
+bool shm_ring::push(const char *data, size_t size, uint64_t *pos)
+{
+	size_t aligned = shm_align(size);
+	if (aligned > m_size)
+		return false;
+
+	uint64_t tail = m_ctl->tail.load(std::memory_order_acquire);
+	uint64_t start = m_head;
+
+	// regions are contiguous, skip the end of the ring if region does not fit there
+	size_t off = start % m_size;
+	if (off + aligned > m_size)
+		start += m_size - off;
+
+	if (start + aligned - tail > m_size)
+		return false;
+
+	memcpy(m_data + start % m_size, data, size);
+	m_head = start + aligned;
+	*pos = start;
+	return true;
+}
+
+std::shared_ptr<char> shm_ring::pop(uint64_t pos, size_t size)
+{
+	size_t aligned = shm_align(size);
+	if (aligned > m_size || (pos % m_size) + aligned > m_size)
+		return std::shared_ptr<char>();
+
+	std::unique_lock<std::mutex> guard(m_lock);
+	region r;
+	r.pos = pos;
+	r.size = aligned;
+	r.released = false;
+	m_regions.push_back(r);
+	guard.unlock();
+
+	auto self = shared_from_this();
+	return std::shared_ptr<char>(m_data + pos % m_size, [self, pos] (char *) {
+				self->release(pos);
+			});
+}
+
+void shm_ring::release(uint64_t pos)
+{
+	std::unique_lock<std::mutex> guard(m_lock);
+
+	for (auto &r: m_regions) {
+		if (r.pos == pos) {
+			r.released = true;
+			break;
+		}
+	}
+
+	uint64_t tail = 0;
+	while (!m_regions.empty() && m_regions.front().released) {
+		tail = m_regions.front().pos + m_regions.front().size;
+		m_regions.pop_front();
+	}
+
+	if (tail)
+		m_ctl->tail.store(tail, std::memory_order_release);
+}
+
+
+io_loop::io_loop() : m_sleeping(false)
+{
+}
+
+io_loop::~io_loop()
+{
+	stop();
+
+	if (m_epollfd >= 0)
+		::close(m_epollfd);
+	if (m_wakefd >= 0)
+		::close(m_wakefd);
+}
+
+int io_loop::start(const cpu_set_t *cpus, const cpu_set_t *worker_cpus)
+{
+	int err;
+
+	if (cpus) {
+		m_cpus = *cpus;
+		m_pinned = true;
+	}
+	if (worker_cpus) {
+		m_worker_cpus = *worker_cpus;
+		m_workers_pinned = true;
+	}
+
+	m_epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (m_epollfd < 0) {
+		err = -errno;
+		LOG(ERROR) << "fpool::io_loop::start: could not create epoll file descriptor" <<
+			": error: " << strerror(-err) << " [" << err << "]";
+		return err;
+	}
+
+	m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_wakefd < 0) {
+		err = -errno;
+		LOG(ERROR) << "fpool::io_loop::start: could not create eventfd" <<
+			": error: " << strerror(-err) << " [" << err << "]";
+		return err;
+	}
+
+	// NULL pointer marks wakeup eventfd
+	err = epoll_add(m_epollfd, m_wakefd, EPOLLIN | EPOLLET, NULL);
+	if (err < 0)
+		return err;
+
+	m_thread = std::thread(std::bind(&io_loop::run, this));
+	return 0;
+}
+
+void io_loop::stop()
+{
+	if (m_thread.joinable()) {
+		m_need_exit = true;
+
+		uint64_t val = 1;
+		ssize_t err = ::write(m_wakefd, &val, sizeof(val));
+		(void) err;
+
+		m_thread.join();
+	}
+}
+
+int io_loop::add(worker *w)
+{
+	std::lock_guard<std::mutex> guard(m_io_lock);
+
+	int err = epoll_add(m_epollfd, w->m_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, w);
+	if (err < 0)
+		return err;
+
+	m_workers.insert(w);
+
+	std::lock_guard<std::mutex> ready_guard(m_ready_lock);
+	w->m_attached = true;
+	w->m_scheduled = false;
+	return 0;
+}
+
+void io_loop::remove(worker *w)
+{
+	std::lock_guard<std::mutex> guard(m_io_lock);
+
+	epoll_ctl(m_epollfd, EPOLL_CTL_DEL, w->m_fd, NULL);
+	m_workers.erase(w);
+
+	// worker can be freed as soon as this function returns, it must not stay in the ready list,
+	// loop holds @m_io_lock while it processes the ready list taken out of @m_ready
+	std::lock_guard<std::mutex> ready_guard(m_ready_lock);
+	w->m_attached = false;
+	m_ready.erase(std::remove(m_ready.begin(), m_ready.end(), w), m_ready.end());
+}
+
+void io_loop::schedule(worker *w)
+{
+	if (w->m_scheduled.exchange(true))
+		return;
+
+	// worker which has been removed stays marked as scheduled until it is added again
+	std::unique_lock<std::mutex> guard(m_ready_lock);
+	if (!w->m_attached)
+		return;
+	m_ready.push_back(w);
+	guard.unlock();
+
+	if (m_sleeping.exchange(false)) {
+		uint64_t val = 1;
+		ssize_t err = ::write(m_wakefd, &val, sizeof(val));
+		(void) err;
+	}
+}
+
+void io_loop::process(worker *w)
+{
+	if (w->m_io_error)
+		return;
+
+	int err = w->io_step();
+	if (err < 0)
+		w->io_failed(err);
+}
+
+bool io_loop::worker_cpus(cpu_set_t *cpus) const
+{
+	if (!m_workers_pinned)
+		return false;
+
+	*cpus = m_worker_cpus;
+	return true;
+}
+
+void io_loop::run()
+{
+	epoll_event ev[64];
+	std::vector<worker *> ready;
+
+	if (m_pinned) {
+		int err = pthread_setaffinity_np(pthread_self(), sizeof(m_cpus), &m_cpus);
+		if (err) {
+			LOG(ERROR) << "fpool::io_loop::run: could not set thread affinity" <<
+				": error: " << strerror(err) << " [" << -err << "]";
+		}
+	}
+
+	while (!m_need_exit) {
+		// schedule() only wakes loop up when it sleeps, check the ready list
+		// after announcing that, worker could have been scheduled in between
+		m_sleeping = true;
+
+		std::unique_lock<std::mutex> guard(m_ready_lock);
+		long timeout = m_ready.empty() ? -1 : 0;
+		guard.unlock();
+
+		int nfds = epoll_wait(m_epollfd, ev, sizeof(ev) / sizeof(ev[0]), timeout);
+		m_sleeping = false;
+
+		if (nfds < 0) {
+			int err = -errno;
+			if (err == -EINTR)
+				continue;
+
+			LOG(ERROR) << "fpool::io_loop::run: could not wait for epoll event: " <<
+				strerror(-err) << " [" << err << "]";
+			break;
+		}
+
+		std::lock_guard<std::mutex> io_guard(m_io_lock);
+
+		for (int i = 0; i < nfds; ++i) {
+			worker *w = (worker *)ev[i].data.ptr;
+			if (!w) {
+				uint64_t val;
+				ssize_t err = ::read(m_wakefd, &val, sizeof(val));
+				(void) err;
+				continue;
+			}
+
+			// worker could have been removed after epoll_wait() returned
+			if (m_workers.find(w) == m_workers.end())
+				continue;
+
+			w->set_events(ev[i].events);
+			process(w);
+		}
+
+		guard.lock();
+		ready.swap(m_ready);
+		guard.unlock();
+
+		// workers in the ready list are registered, remove() purges them from it
+		for (auto w: ready) {
+			w->m_scheduled = false;
+			process(w);
+		}
+		ready.clear();
+	}
+}
+
+
+const int histogram::sub_bucket_bits;
+const int histogram::sub_buckets;
+const int histogram::buckets;
+
+int histogram::bucket(uint64_t value)
+{
+	if (value < (uint64_t)sub_buckets * 2)
+		return value;
+
+	// values in [2^n, 2^(n+1)) are split into @sub_buckets buckets of 2^(n - sub_bucket_bits) width
+	int n = 63 - __builtin_clzll(value);
+	int shift = n - sub_bucket_bits;
+	return shift * sub_buckets + (value >> shift);
+}
+
+uint64_t histogram::bucket_max(int bucket)
+{
+	if (bucket < sub_buckets * 2)
+		return bucket;
+
+	int shift = bucket / sub_buckets - 1;
+	uint64_t sub = bucket % sub_buckets + sub_buckets;
+	return ((sub + 1) << shift) - 1;
+}
+
+histogram::histogram() : m_counts(buckets)
+{
+}
+
+histogram::histogram(const std::vector<uint64_t> &counts, uint64_t sum, uint64_t max)
+	: m_counts(counts)
+	, m_sum(sum)
+	, m_max(max)
+{
+	m_counts.resize(buckets);
+	for (auto c: m_counts) {
+		m_count += c;
+	}
+}
+
+void histogram::record(uint64_t value, uint64_t count)
+{
+	m_counts[bucket(value)] += count;
+	m_count += count;
+	m_sum += value * count;
+	m_max = std::max(m_max, value);
+}
+
+void histogram::merge(const histogram &other)
+{
+	for (int i = 0; i < buckets; ++i) {
+		m_counts[i] += other.m_counts[i];
+	}
+
+	m_count += other.m_count;
+	m_sum += other.m_sum;
+	m_max = std::max(m_max, other.m_max);
+}
+
+uint64_t histogram::count() const
+{
+	return m_count;
+}
+
+uint64_t histogram::sum() const
+{
+	return m_sum;
+}
+
+uint64_t histogram::max() const
+{
+	return m_max;
+}
+
+double histogram::mean() const
+{
+	return m_count ? (double)m_sum / m_count : 0;
+}
+
+uint64_t histogram::percentile(double percentile) const
+{
+	uint64_t rank = (uint64_t)(percentile / 100.0 * m_count + 0.5);
+	rank = std::max(rank, (uint64_t)1);
+
+	uint64_t seen = 0;
+	for (int i = 0; i < buckets; ++i) {
+		seen += m_counts[i];
+		if (seen >= rank)
+			return std::min(bucket_max(i), m_max);
+	}
+
+	return m_max;
+}
+
+const std::vector<uint64_t> &histogram::counts() const
+{
+	return m_counts;
+}
+
+worker::atomic_histogram::atomic_histogram()
+	: sum(0)
+	, max(0)
+{
+	for (auto &c: counts) {
+		c = 0;
+	}
+}
+
+void worker::atomic_histogram::record(uint64_t value)
+{
+	counts[histogram::bucket(value)].fetch_add(1, std::memory_order_relaxed);
+	sum.fetch_add(value, std::memory_order_relaxed);
+
+	uint64_t prev = max.load(std::memory_order_relaxed);
+	while (value > prev && !max.compare_exchange_weak(prev, value, std::memory_order_relaxed))
+		;
+}
+
+void worker::atomic_histogram::load(histogram *h) const
+{
+	std::vector<uint64_t> c(histogram::buckets);
+	for (int i = 0; i < histogram::buckets; ++i) {
+		c[i] = counts[i].load(std::memory_order_relaxed);
+	}
+
+	*h = histogram(c, sum.load(std::memory_order_relaxed), max.load(std::memory_order_relaxed));
+}
+
+worker::worker(io_loop *loop, const options &opt, shared_queue *shared, admission *adm)
+	: m_opt(opt)
+	, m_loop(loop)
+	, m_shared(shared)
+	, m_admission(adm)
+	, m_scheduled(false)
+	, m_queued(0)
+	, m_in_flight_count(0)
+	, m_outstanding_bytes(0)
+	, m_queue_wait(0)
+	, m_last_active(std::chrono::steady_clock::now().time_since_epoch().count())
+	, m_retired(false)
+	, m_requests(0)
+	, m_request_bytes(0)
+	, m_replies(0)
+	, m_reply_bytes(0)
+	, m_timeouts(0)
+	, m_starts(0)
+	, m_check_deadlines(false)
+{
+	m_queue.configure(m_opt);
+
+	for (auto &c: m_priority) {
+		c.queued = 0;
+		c.completed = 0;
+		c.total_usec = 0;
+		c.max_usec = 0;
+	}
+
+	if (m_opt.max_in_flight == 0)
+		m_opt.max_in_flight = 1;
+}
+
+worker::~worker()
+{
+	int status;
+	stop(&status);
+}
+
+int worker::create_rings(const options &opt, spawned *sp)
+{
+	if (!opt.shm_ring_size)
+		return 0;
+
+	std::shared_ptr<shm_ring> tx = std::make_shared<shm_ring>();
+	std::shared_ptr<shm_ring> rx = std::make_shared<shm_ring>();
+
+	int err = tx->map(opt.shm_ring_size);
+	if (err)
+		return err;
+
+	err = rx->map(opt.shm_ring_size);
+	if (err)
+		return err;
+
+	sp->tx_ring = tx;
+	sp->rx_ring = rx;
+	return 0;
+}
+
+int worker::fork_process(const options &opt, callback_t callback, batch_callback_t batch_callback,
+		stream_callback_t stream_callback, spawned *sp)
+{
+	int err;
+	int fd[2];
+
+	err = create_rings(opt, sp);
+	if (err) {
+		LOG(ERROR) << "fpool::worker::fork_process: could not create shared memory rings" <<
+			": error: " << strerror(-err) << " [" << err << "]";
+		return err;
+	}
+
+	err = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fd);
+	if (err == -1) {
+		err = -errno;
+		LOG(ERROR) << "fpool::worker::fork_process: could not create socketpair" <<
+			": error: " << strerror(-err) << " [" << err << "]";
+		return err;
+	}
+
+	pid_t pid = fork();
+	if (pid == -1) {
+		err = -errno;
+		LOG(ERROR) << "fpool::worker::fork_process: could not fork" <<
+			": error: " << strerror(-err) << " [" << err << "]";
+		::close(fd[0]);
+		::close(fd[1]);
+		return err;
+	}
+
+	// child process
+	if (pid == 0) {
+		::close(fd[0]);
+
+		worker w(NULL, opt);
+		w.m_tx_ring = sp->tx_ring;
+		w.m_rx_ring = sp->rx_ring;
+		w.run_child(fd[1], callback, batch_callback, stream_callback);
+	}
+
+	::close(fd[1]);
+	sp->pid = pid;
+	sp->fd = descriptor(fd[0]);
+	return 0;
+}
+
+void worker::run_child(int fd, callback_t callback, batch_callback_t batch_callback, stream_callback_t stream_callback)
+{
+	setsid();
+
+	m_fd = fd;
+	m_need_exit = false;
+
+	// child writes into the ring parent reads from and vice versa
+	std::swap(m_tx_ring, m_rx_ring);
+
+	m_epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (m_epollfd < 0) {
+		exit(-errno);
+	}
+
+	m_readable = m_writable = m_hup = false;
+	m_rx_start = m_rx_end = 0;
+	m_rx_fds.clear();
+	int err = epoll_add(m_epollfd, m_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, this);
+	if (err < 0) {
+		exit(err);
+	}
+
+	m_pid = getpid();
+
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGTERM);
+	sigprocmask(SIG_UNBLOCK, &set, NULL);
+
+	LOG(INFO) << "worker: " << m_pid << ", need_exit: " << m_need_exit << ": starting";
+	run(callback, batch_callback, stream_callback);
+	LOG(INFO) << "worker: " << m_pid << ": exiting";
+	exit(0);
+}
+
+int worker::start(worker::callback_t callback, worker::batch_callback_t batch_callback,
+		worker::stream_callback_t stream_callback)
+{
+	spawned sp;
+	int err = fork_process(m_opt, callback, batch_callback, stream_callback, &sp);
+	if (err)
+		return err;
+
+	return start(std::move(sp));
+}
+
+int worker::start(spawned &&sp)
+{
+	m_need_exit = false;
+	m_starts++;
+
+	m_pid = sp.pid;
+	m_fd = sp.fd.release();
+	m_tx_ring = std::move(sp.tx_ring);
+	m_rx_ring = std::move(sp.rx_ring);
+
+	m_readable = m_writable = m_hup = false;
+	m_rx_start = m_rx_end = 0;
+	m_rx_fds.clear();
+	m_io_error = 0;
+
+	// reply buffers are allocated by the child, so it has to be pinned before it gets the first request
+	cpu_set_t cpus;
+	if (m_loop->worker_cpus(&cpus)) {
+		if (sched_setaffinity(m_pid, sizeof(cpus), &cpus) < 0) {
+			int err = -errno;
+			LOG(ERROR) << "fpool::worker::start: could not set affinity of process " << m_pid <<
+				": error: " << strerror(-err) << " [" << err << "]";
+		}
+
+		m_prefault = true;
+	}
+
+	int err = m_loop->add(this);
+	if (err < 0)
+		return err;
+
+	// messages could have been queued while worker was restarting
+	m_loop->schedule(this);
+
+	LOG(INFO) << "fpool::worker::start: process " << m_pid << " has been started";
+	return 0;
+}
+
+void worker::close()
+{
+	if (m_fd >= 0) {
+		m_loop->remove(this);
+		fail_pending(-ECONNRESET);
+		m_reply = message();
+		m_rx_fds.clear();
+
+		::close(m_fd);
+		m_fd = -1;
+	}
+}
+
+int worker::stop(int *status)
+{
+	m_need_exit = true;
+
+	if (m_pid < 0) {
+		*status = 0;
+		return 0;
+	}
+
+	LOG(INFO) << "fpool::worker::stop: sendig SIGTERM to pid " << m_pid;
+	int err = kill(m_pid, SIGTERM);
+	if (err < 0) {
+		err = -errno;
+		LOG(ERROR) << "fpool::worker::stop: could not send SIGTERM to pid " << m_pid <<
+			", error: " << strerror(-err) << " [" << err << "]";
+		return err;
+	}
+
+	pid_t pid = 0;
+	for (int i = 0; i < 10; ++i) {
+		pid = waitpid(m_pid, status, WNOHANG);
+		if (pid < 0) {
+			err = -errno;
+
+			LOG(ERROR) << "fpool::worker::stop: could not wait1 for to pid " << m_pid <<
+				", error: " << strerror(-err) << " [" << err << "]";
+			return err;
+		}
+
+		if (pid > 0)
+			break;
+
+		usleep(10000);
+	}
+
+	if (pid == 0) {
+		LOG(ERROR) << "fpool::worker::stop: SIGTERM has been ignored, sending SIGKILL to pid " << m_pid;
+
+		err = kill(m_pid, SIGKILL);
+		if (err < 0) {
+			err = -errno;
+			LOG(ERROR) << "fpool::worker::stop: could not send SIGKILL to pid " << m_pid <<
+				", error: " << strerror(-err) << " [" << err << "]";
+			return err;
+		}
+
+		pid = waitpid(m_pid, status, 0);
+		if (pid <= 0) {
+			err = -errno;
+			LOG(ERROR) << "fpool::worker::stop: could not wait2 for pid " << m_pid <<
+				", error: " << strerror(-err) << " [" << err << "]";
+			return err;
+		}
+	}
+
+	close();
+	LOG(INFO) << "fpool::worker::stop: process " << m_pid << " has been stopped";
+	m_pid = -1;
+	return 0;
+}
+
+int worker::terminate()
+{
+	m_need_exit = true;
+
+	if (m_pid < 0)
+		return -ESRCH;
+
+	LOG(INFO) << "fpool::worker::terminate: sending SIGTERM to pid " << m_pid;
+	int err = kill(m_pid, SIGTERM);
+	if (err < 0) {
+		err = -errno;
+		LOG(ERROR) << "fpool::worker::terminate: could not send SIGTERM to pid " << m_pid <<
+			", error: " << strerror(-err) << " [" << err << "]";
+	}
+
+	close();
+	m_pid = -1;
+	return err;
+}
+
+int worker::restart(worker::callback_t callback, worker::batch_callback_t batch_callback,
+		worker::stream_callback_t stream_callback)
+{
+	int status;
+	int err = stop(&status);
+	if (err) {
+		if (err != -ESRCH)
+			return err;
+	}
+
+	return start(callback, batch_callback, stream_callback);
+}
+
+pid_t worker::pid() const
+{
+	return m_pid;
+}
+
+io_loop *worker::loop() const
+{
+	return m_loop;
+}
+
+size_t worker::queue_size() const
+{
+	return m_queued;
+}
+
+size_t worker::in_flight() const
+{
+	return m_in_flight_count;
+}
+
+uint64_t worker::outstanding_bytes() const
+{
+	return m_outstanding_bytes;
+}
+
+uint64_t worker::take_queue_wait()
+{
+	return m_queue_wait.exchange(0);
+}
+
+std::chrono::steady_clock::time_point worker::last_active() const
+{
+	return std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(m_last_active.load()));
+}
+
+void worker::retire(std::function<void ()> drained)
+{
+	m_drained = std::move(drained);
+
+	// requests are pulled from the shared queue under its lock, so once it has been released
+	// pulled requests are already counted as in flight and no new ones are pulled
+	if (m_shared) {
+		std::lock_guard<std::mutex> guard(m_shared->lock);
+		m_retired = true;
+	} else {
+		m_retired = true;
+	}
+}
+
+void worker::metrics(worker_metrics *m) const
+{
+	m->pid = m_pid;
+
+	m_queue_wait_hist.load(&m->queue_wait);
+	m_service_hist.load(&m->service);
+	m_latency_hist.load(&m->latency);
+
+	m->requests = m_requests;
+	m->request_bytes = m_request_bytes;
+	m->replies = m_replies;
+	m->reply_bytes = m_reply_bytes;
+	m->queued = queue_size();
+	m->in_flight = in_flight();
+	m->timeouts = m_timeouts;
+	m->restarts = m_starts ? m_starts - 1 : 0;
+}
+
+void worker::priority_counters(std::vector<priority_stats> *stats) const
+{
+	for (int prio = 0; prio < message::priorities; ++prio) {
+		auto &c = m_priority[prio];
+		auto &st = (*stats)[prio];
+
+		st.queued += c.queued;
+		st.completed += c.completed;
+		st.total_usec += c.total_usec;
+		st.max_usec = std::max(st.max_usec, c.max_usec.load());
+	}
+}
+
+void worker::queue(message &&msg, completion_t complete)
+{
+	queue(job(std::move(msg), std::move(complete)));
+}
+
+void worker::queue(job &&j)
+{
+	uint64_t size = j.msg.header.size;
+
+	std::unique_lock<std::mutex> lk(m_lock);
+	m_priority[j.msg.priority()].queued++;
+	m_queue.push(std::move(j));
+	m_queued++;
+	m_outstanding_bytes += size;
+	lk.unlock();
+
+	m_loop->schedule(this);
+}
+
+void worker::take_queue(std::deque<job> *queue)
+{
+	std::deque<job> jobs;
+
+	std::unique_lock<std::mutex> lk(m_lock);
+	m_queue.take(&jobs);
+	for (auto &j: jobs) {
+		m_outstanding_bytes -= j.msg.header.size;
+		m_priority[j.msg.priority()].queued--;
+	}
+	m_queued -= jobs.size();
+	lk.unlock();
+
+	queue->swap(jobs);
+}
+
+void worker::job_queue::configure(const options &opt)
+{
+	m_policy = opt.priority;
+	for (int i = 0; i < message::priorities; ++i) {
+		m_weights[i] = std::max(opt.priority_weights[i], 1);
+	}
+}
+
+void worker::job_queue::push(job &&j)
+{
+	m_queues[j.msg.priority()].emplace_back(std::move(j));
+	m_size++;
+}
+
+worker::job worker::job_queue::pop()
+{
+	auto &q = m_queues[next_class()];
+
+	job j(std::move(q.front()));
+	q.pop_front();
+	m_size--;
+	return j;
+}
+
+int worker::job_queue::next_class()
+{
+	if (m_policy == options::priority_strict) {
+		for (int prio = message::priorities - 1; prio > 0; --prio) {
+			if (!m_queues[prio].empty())
+				return prio;
+		}
+
+		return 0;
+	}
+
+	// classes are visited from the highest one, empty classes are skipped
+	while (true) {
+		if (m_credit > 0 && !m_queues[m_class].empty()) {
+			m_credit--;
+			return m_class;
+		}
+
+		m_class = m_class == 0 ? message::priorities - 1 : m_class - 1;
+		m_credit = m_weights[m_class];
+	}
+}
+
+void worker::job_queue::take(std::deque<job> *jobs)
+{
+	for (int prio = message::priorities - 1; prio >= 0; --prio) {
+		auto &q = m_queues[prio];
+		for (auto &j: q) {
+			jobs->emplace_back(std::move(j));
+		}
+		q.clear();
+	}
+
+	m_size = 0;
+}
+
+static inline bool job_expired(const worker::deadline_t &deadline, const worker::deadline_t &now)
+{
+	return deadline != worker::deadline_t() && deadline <= now;
+}
+
+static void complete_expired(worker::job &j)
+{
+	message reply = message::copy_header(j.msg);
+	reply.header.status = -ETIMEDOUT;
+	j.complete(reply);
+}
+
+void worker::check_deadlines()
+{
+	m_check_deadlines = true;
+	m_loop->schedule(this);
+}
+
+void worker::notify()
+{
+	m_loop->schedule(this);
+}
+
+int worker::wait_events(long timeout)
+{
+	epoll_event ev;
+
+	int nfds = epoll_wait(m_epollfd, &ev, 1, timeout);
+	if (nfds < 0) {
+		int err = -errno;
+		if (err == -EINTR)
+			return 0;
+
+		LOG(ERROR) << "worker: " << m_pid << ": could not wait for epoll event: " <<
+			strerror(-err) << " [" << err << "]";
+		return err;
+	}
+
+	if (nfds == 1)
+		set_events(ev.events);
+
+	return nfds;
+}
+
+void worker::set_events(uint32_t events)
+{
+	dprintf("%d: ready: fd: %d, events: %x\n", getpid(), m_fd, events);
+
+	if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+		m_readable = true;
+	if (events & EPOLLOUT)
+		m_writable = true;
+	if (events & (EPOLLHUP | EPOLLERR)) {
+		LOG(ERROR) << "worker: " << m_pid << ": fd: " << m_fd <<
+			std::hex << std::setfill('0') <<
+			", events: " << events;
+		m_hup = true;
+	}
+}
+
+// runs in forked child
+message worker::process(const message &req, callback_t &callback, batch_callback_t &batch_callback)
+{
+	if (!(req.header.flags & message::flag_batch))
+		return callback(req);
+
+	std::vector<message> reqs;
+	int err = message::unpack(req, &reqs);
+	if (err) {
+		LOG(ERROR) << "worker: " << m_pid << ": could not unpack batch: " << req.str() << ", error: " << err;
+
+		message reply = message::copy_header(req);
+		reply.header.flags &= ~message::transport_flags_mask;
+		reply.header.status = err;
+		return reply;
+	}
+
+	std::vector<message> replies;
+	if (batch_callback) {
+		replies = batch_callback(reqs);
+	} else {
+		replies.reserve(reqs.size());
+		for (auto &r: reqs) {
+			replies.emplace_back(callback(r));
+		}
+	}
+
+	// like single replies, batched ones carry request ids
+	if (replies.size() == reqs.size()) {
+		for (size_t i = 0; i < reqs.size(); ++i) {
+			replies[i].header.id = reqs[i].header.id;
+		}
+	}
+
+	return message::pack(replies);
+}
+
+int worker::write_replies(std::deque<message> &replies)
+{
+	int err = 0;
+
+	while (m_writable && !replies.empty()) {
+		message *msgs[max_write_iov / 2];
+		size_t num = 0;
+		for (auto it = replies.begin(); it != replies.end() && num < max_write_iov / 2; ++it) {
+			msgs[num++] = &(*it);
+		}
+
+		err = write_some(msgs, num);
+		if (err < 0 && err != -EAGAIN)
+			return err;
+
+		while (!replies.empty() && replies.front().io_completed()) {
+			replies.pop_front();
+		}
+
+		if (err == -EAGAIN) {
+			m_writable = false;
+			break;
+		}
+	}
+
+	return err;
+}
+
+int worker::read_message(message &msg)
+{
+	while (true) {
+		if (m_readable) {
+			ssize_t err = read_some(msg);
+			if (err < 0)
+				return err;
+
+			if (msg.io_completed())
+				return 0;
+
+			m_readable = false;
+		}
+
+		int err = wait_events(-1);
+		if (err < 0)
+			return err;
+	}
+}
+
+int worker::flush_replies(std::deque<message> &replies)
+{
+	while (!replies.empty()) {
+		int err = write_replies(replies);
+		if (err < 0 && err != -EAGAIN)
+			return err;
+
+		if (!replies.empty() && !m_writable) {
+			err = wait_events(-1);
+			if (err < 0)
+				return err;
+		}
+	}
+
+	return 0;
+}
+
+stream::stream(worker *w, uint64_t id, std::deque<message> *pending, message *msg, std::deque<message> *replies)
+	: m_worker(w)
+	, m_id(id)
+	, m_pending(pending)
+	, m_msg(msg)
+	, m_replies(replies)
+{
+}
+
+int stream::read(message *chunk)
+{
+	if (m_ended)
+		return 1;
+
+	// chunks could have been read ahead together with the head
+	if (!m_pending->empty()) {
+		*chunk = std::move(m_pending->front());
+		m_pending->pop_front();
+	} else {
+		int err = m_worker->read_message(*m_msg);
+		if (err < 0) {
+			LOG(ERROR) << "worker: " << m_worker->m_pid << ", stream read error: " << err << ", exiting";
+			exit(err);
+		}
+
+		*chunk = std::move(*m_msg);
+		*m_msg = message();
+	}
+
+	if (!(chunk->header.flags & message::flag_stream) || chunk->header.id != m_id) {
+		LOG(ERROR) << "worker: " << m_worker->m_pid << ": unexpected message in stream " << m_id <<
+			": " << chunk->str() << ", exiting";
+		exit(-EPROTO);
+	}
+
+	if (chunk->header.flags & message::flag_stream_end) {
+		m_ended = true;
+		int status = chunk->header.status;
+		*chunk = message();
+		return status < 0 ? status : 1;
+	}
+
+	chunk->header.flags &= ~message::transport_flags_mask;
+	return 0;
+}
+
+void stream::write(message &&chunk)
+{
+	chunk.header.id = m_id;
+	chunk.header.flags &= ~(message::flag_shm | message::flag_batch | message::flag_stream_end);
+	chunk.header.flags |= message::flag_stream;
+	chunk.io_offset = 0;
+
+	m_replies->emplace_back(std::move(chunk));
+
+	int err = m_worker->flush_replies(*m_replies);
+	if (err < 0) {
+		LOG(ERROR) << "worker: " << m_worker->m_pid << ", stream write error: " << err << ", exiting";
+		exit(err);
+	}
+}
+
+// runs in forked child
+void worker::run(callback_t callback, batch_callback_t batch_callback, stream_callback_t stream_callback)
+{
+	// requests which have been read ahead while previous job was being processed
+	std::deque<message> pending;
+	// replies which are being written, front one is partially written
+	std::deque<message> replies;
+	message msg;
+
+	while (!m_need_exit) {
+		ssize_t err;
+
+		// socket is registered in edge-triggered mode, read everything available
+		while (m_readable) {
+			err = read_some(msg);
+			if (err < 0) {
+				LOG(ERROR) << "worker: " << m_pid << ", read error: " << err << ", exiting";
+				exit(err);
+			}
+
+			if (!msg.io_completed()) {
+				m_readable = false;
+				break;
+			}
+
+			pending.emplace_back(std::move(msg));
+			msg = message();
+		}
+
+		err = write_replies(replies);
+		if (err < 0 && err != -EAGAIN) {
+			LOG(ERROR) << "worker: " << m_pid << ", write error: " << err << ", exiting";
+			exit(err);
+		}
+
+		if (!pending.empty()) {
+			message req(std::move(pending.front()));
+			pending.pop_front();
+
+			VLOG(2) << "worker: " << m_pid << ": job: " << req.str();
+
+			message reply;
+			if (req.header.flags & message::flag_stream) {
+				stream s(this, req.header.id, &pending, &msg, &replies);
+
+				req.header.flags &= ~message::transport_flags_mask;
+				if (stream_callback) {
+					reply = stream_callback(req, s);
+				} else {
+					reply = message::copy_header(req);
+					reply.header.status = -ENOTSUP;
+				}
+
+				// request chunks which have not been read by the callback are dropped
+				message chunk;
+				while (s.read(&chunk) == 0) {
+				}
+
+				reply.header.flags |= message::flag_stream | message::flag_stream_end;
+			} else {
+				reply = process(req, callback, batch_callback);
+			}
+			// parent matches replies to requests by id, which has been set by the IO thread
+			reply.header.id = req.header.id;
+			reply.header.flags &= ~message::flag_shm;
+			reply.io_offset = 0;
+
+			VLOG(2) << "worker: " << m_pid << ": job: " << req.str() << " -> " << reply.str();
+			replies.emplace_back(std::move(reply));
+			continue;
+		}
+
+		if (m_writable && !replies.empty())
+			continue;
+
+		err = wait_events(-1);
+		if (err < 0) {
+			LOG(ERROR) << "worker: " << m_pid << ", wait error: " << err << ", exiting";
+			exit(err);
+		}
+	}
+}
+
+void worker::io_failed(int err)
+{
+	// there was an IO error, protocol is already broken,
+	// worker can not recover and should be restarted
+	LOG(ERROR) << "worker: " << m_pid << ", IO error: " << err << ", killing itself";
+
+	m_io_error = err;
+	fail_pending(err);
+	kill(m_pid, SIGKILL);
+}
+
+void worker::fail_pending(int err)
+{
+	std::deque<request> sending;
+	sending.swap(m_sending);
+	for (auto &req: sending) {
+		message reply = message::copy_header(req.hdr);
+		reply.header.status = err;
+		complete_request(req, reply);
+	}
+
+	std::unordered_map<uint64_t, request> in_flight;
+	in_flight.swap(m_in_flight);
+	for (auto &p: in_flight) {
+		message reply = message::copy_header(p.second.hdr);
+		reply.header.status = err;
+		complete_request(p.second, reply);
+	}
+}
+
+void worker::complete_request(request &req, message &reply)
+{
+	// streaming request could have already been completed while its chunks were being sent
+	if (!req.complete)
+		return;
+
+	completion_t complete;
+	complete.swap(req.complete);
+
+	if (req.deadline != deadline_t() && req.deadline <= std::chrono::system_clock::now())
+		m_timeouts++;
+
+	// counters are updated before completion, so that it could schedule new messages
+	// taking into account that this one has been completed
+	m_in_flight_count--;
+	m_outstanding_bytes -= req.size;
+
+	auto now = std::chrono::steady_clock::now();
+	m_last_active = now.time_since_epoch().count();
+
+	auto &c = m_priority[req.hdr.priority()];
+	uint64_t usec = std::chrono::duration_cast<std::chrono::microseconds>(now - req.queued_at).count();
+	m_latency_hist.record(usec);
+	m_service_hist.record(std::chrono::duration_cast<std::chrono::microseconds>(now - req.sent_at).count());
+	c.completed++;
+	c.total_usec += usec;
+	// IO loop is the only writer
+	if (usec > c.max_usec)
+		c.max_usec = usec;
+
+	if (m_admission)
+		m_admission->notify();
+
+	complete(reply);
+
+	if (m_retired && m_in_flight_count == 0)
+		m_drained();
+}
+
+// Requests which have not been written yet are completed with -ETIMEDOUT and dropped, sent ones have
+// already been completed by their deadline timers, but stay in flight until reply is received.
+// Returns -ETIMEDOUT if there is request which has not been answered @options::kill_timeout after its deadline,
+// worker is restarted then and all its requests are failed.
+int worker::expire_sent()
+{
+	auto now = std::chrono::system_clock::now();
+	auto kill_deadline = now - std::chrono::milliseconds(m_opt.kill_timeout);
+	int err = 0;
+
+	for (auto it = m_sending.begin(); it != m_sending.end();) {
+		if (it->msg.io_offset == 0 && !it->started && job_expired(it->deadline, now)) {
+			message reply = message::copy_header(it->hdr);
+			reply.header.status = -ETIMEDOUT;
+			complete_request(*it, reply);
+
+			it = m_sending.erase(it);
+			continue;
+		}
+
+		if (job_expired(it->deadline, kill_deadline))
+			err = -ETIMEDOUT;
+		++it;
+	}
+
+	for (auto &p: m_in_flight) {
+		if (job_expired(p.second.deadline, kill_deadline))
+			err = -ETIMEDOUT;
+	}
+
+	if (err) {
+		LOG(ERROR) << "worker: " << m_pid << ": request has not been completed " <<
+			m_opt.kill_timeout << " ms after its deadline, restarting worker";
+	}
+
+	return err;
+}
+
+int worker::complete_reply(message &reply)
+{
+	uint64_t flags = reply.header.flags;
+	reply.header.flags &= ~(message::flag_stream | message::flag_stream_end);
+
+	// streaming request is answered while its chunks are still being sent
+	request *req = NULL;
+	auto it = m_in_flight.find(reply.header.id);
+	if (it != m_in_flight.end()) {
+		req = &it->second;
+	} else if ((flags & message::flag_stream) && !m_sending.empty() &&
+			m_sending.front().stream && m_sending.front().msg.header.id == reply.header.id) {
+		req = &m_sending.front();
+	}
+
+	if (!req) {
+		LOG(ERROR) << "worker: " << m_pid << ": received reply for unknown request: " << reply.str();
+		return -EPROTO;
+	}
+
+	reply.header.id = req->hdr.header.id;
+	m_reply_bytes += reply.header.size;
+
+	if ((flags & message::flag_stream) && !(flags & message::flag_stream_end)) {
+		if (req->complete && req->stream->chunk)
+			req->stream->chunk(reply);
+		return 0;
+	}
+
+	m_replies++;
+
+	VLOG(2) << "worker: " << m_pid << ": completing request with reply: " << reply.str();
+	if (it == m_in_flight.end()) {
+		req->replied = true;
+		complete_request(*req, reply);
+		return 0;
+	}
+
+	request r(std::move(it->second));
+	m_in_flight.erase(it);
+	complete_request(r, reply);
+	return 0;
+}
+
+void worker::push_request(job &j)
+{
+	request req;
+	req.hdr = message::copy_header(j.msg);
+	req.size = j.msg.header.size;
+	req.deadline = j.deadline;
+	req.queued_at = j.queued_at;
+	req.msg = std::move(j.msg);
+	req.msg.header.id = ++m_seq;
+	req.msg.header.flags &= ~message::flag_shm;
+	req.msg.io_offset = 0;
+	req.complete = std::move(j.complete);
+
+	req.stream = std::move(j.stream);
+	if (req.stream)
+		req.msg.header.flags |= message::flag_stream;
+
+	auto now = std::chrono::steady_clock::now();
+	m_last_active = now.time_since_epoch().count();
+
+	// IO loop is the only writer, controller resets it
+	uint64_t wait = std::chrono::duration_cast<std::chrono::microseconds>(now - j.queued_at).count();
+	if (wait > m_queue_wait)
+		m_queue_wait = wait;
+	m_queue_wait_hist.record(wait);
+
+	req.sent_at = now;
+	m_requests++;
+	m_request_bytes += req.size;
+
+	m_sending.emplace_back(std::move(req));
+	m_in_flight_count++;
+}
+
+void worker::next_chunk(request &req)
+{
+	uint64_t id = req.msg.header.id;
+	message chunk;
+	int err = 1;
+
+	// request which has been completed or expired is ended right away
+	if (req.complete && !job_expired(req.deadline, std::chrono::system_clock::now()))
+		err = req.stream->source(&chunk);
+
+	if (err) {
+		chunk = message();
+		chunk.header.status = err < 0 ? err : 0;
+		req.last_chunk = true;
+	}
+
+	// descriptor chunks are passed as is
+	chunk.header.id = id;
+	chunk.header.flags &= ~(message::flag_shm | message::flag_batch | message::flag_stream_end);
+	chunk.header.flags |= message::flag_stream;
+	if (req.last_chunk)
+		chunk.header.flags |= message::flag_stream_end;
+	chunk.io_offset = 0;
+
+	m_request_bytes += chunk.header.size;
+
+	req.msg = std::move(chunk);
+	req.started = true;
+}
+
+bool worker::fill_pipeline()
+{
+	bool filled = false;
+
+	// requests whose deadline has passed have already been completed by their deadline timers,
+	// they are dropped here instead of being searched for in the queues when timers fire
+	auto now = std::chrono::system_clock::now();
+	std::vector<job> expired;
+
+	std::unique_lock<std::mutex> lk(m_lock);
+	while (!m_queue.empty() && m_sending.size() + m_in_flight.size() < m_opt.max_in_flight) {
+		job j = m_queue.pop();
+		m_queued--;
+		m_priority[j.msg.priority()].queued--;
+
+		if (job_expired(j.deadline, now)) {
+			m_outstanding_bytes -= j.msg.header.size;
+			expired.emplace_back(std::move(j));
+			continue;
+		}
+
+		push_request(j);
+		filled = true;
+	}
+	lk.unlock();
+
+	if (m_shared && !m_retired && m_sending.size() + m_in_flight.size() < m_opt.max_in_flight) {
+		// worker could have been retired after @m_retired has been checked above
+		std::unique_lock<std::mutex> guard(m_shared->lock);
+		while (!m_retired && !m_shared->queue.empty() && m_sending.size() + m_in_flight.size() < m_opt.max_in_flight) {
+			job j = m_shared->queue.pop();
+			m_shared->bytes -= j.msg.header.size;
+
+			if (job_expired(j.deadline, now)) {
+				expired.emplace_back(std::move(j));
+				continue;
+			}
+
+			m_outstanding_bytes += j.msg.header.size;
+			push_request(j);
+			filled = true;
+		}
+	}
+
+	if (!expired.empty()) {
+		m_timeouts += expired.size();
+		if (m_admission)
+			m_admission->notify();
+
+		// completions can schedule new requests
+		for (auto &j: expired) {
+			complete_expired(j);
+		}
+	}
+
+	return filled;
+}
+
+int worker::io_step()
+{
+	ssize_t err = 0;
+
+	if (m_check_deadlines.exchange(false)) {
+		err = expire_sent();
+		if (err < 0)
+			return err;
+	}
+
+	// IO loop thread is pinned, rings are allocated on its node before the first message is sent
+	if (m_prefault) {
+		m_prefault = false;
+
+		if (m_tx_ring)
+			m_tx_ring->prefault();
+		if (m_rx_ring)
+			m_rx_ring->prefault();
+	}
+
+	fill_pipeline();
+
+	while (m_writable || m_readable) {
+		while (m_writable && !m_sending.empty()) {
+			// several queued messages are sent with a single sendmsg()
+			message *msgs[max_write_iov / 2];
+			size_t num = 0;
+			for (auto it = m_sending.begin(); it != m_sending.end() && num < max_write_iov / 2; ++it) {
+				msgs[num++] = &it->msg;
+
+				// next chunk is taken only when the previous one has been written,
+				// requests queued after the stream are sent when it has ended
+				if (it->stream && !it->last_chunk)
+					break;
+			}
+
+			err = write_some(msgs, num);
+			if (err < 0 && err != -EAGAIN)
+				return err;
+
+			while (!m_sending.empty() && m_sending.front().msg.io_completed()) {
+				request &req = m_sending.front();
+
+				if (req.stream && !req.last_chunk) {
+					next_chunk(req);
+					break;
+				}
+
+				// final reply to the streaming request has already been received
+				if (req.replied) {
+					m_sending.pop_front();
+					continue;
+				}
+
+				uint64_t id = req.msg.header.id;
+				// only original header is needed to complete request, data can be freed
+				req.msg = message();
+
+				m_in_flight.insert(std::make_pair(id, std::move(req)));
+				m_sending.pop_front();
+			}
+
+			if (err == -EAGAIN) {
+				m_writable = false;
+				break;
+			}
+		}
+
+		while (m_readable) {
+			err = read_some(m_reply);
+			if (err < 0)
+				return err;
+
+			if (!m_reply.io_completed()) {
+				m_readable = false;
+				break;
+			}
+
+			err = complete_reply(m_reply);
+			if (err < 0)
+				return err;
+
+			m_reply = message();
+		}
+
+		// replies have freed pipeline slots, but if nothing can be sent,
+		// socket stays writable and will be used when new message is queued
+		if (!fill_pipeline())
+			break;
+	}
+
+	if (m_hup)
+		return -EIO;
+
+	return 0;
+}
+
+// Places payload into shared memory ring if possible, called before the first byte of the message is sent.
+void worker::prepare_write(message &msg)
+{
+	if (msg.header.flags & (message::flag_shm | message::flag_fd))
+		return;
+
+	uint64_t pos;
+	if (m_tx_ring && msg.header.size && m_tx_ring->push(msg.data.get(), msg.header.size, &pos)) {
+		msg.header.flags |= message::flag_shm;
+		msg.header.offset = pos;
+	}
+}
+
+// Number of bytes which have to be sent for the message starting from @msg.io_offset,
+// payload of shared memory and file descriptor messages is not sent over the socket
+static inline size_t wire_size(const message &msg)
+{
+	if (msg.header.flags & (message::flag_shm | message::flag_fd))
+		return message::header_size;
+
+	return message::header_size + msg.header.size;
+}
+
+int worker::write_some(message **msgs, size_t num)
+{
+	size_t pos = 0;
+
+	while (pos < num) {
+		struct iovec iov[max_write_iov];
+		int iovcnt = 0;
+		int pass_fd = -1;
+
+		for (size_t i = pos; i < num && iovcnt + 2 <= max_write_iov; ++i) {
+			message &msg = *msgs[i];
+
+			// descriptor is attached to the sendmsg() which starts the message, it is sent
+			// together with the first written byte, so it is never attached twice
+			if ((msg.header.flags & message::flag_fd) && msg.io_offset == 0) {
+				if (i != pos)
+					break;
+
+				pass_fd = msg.fd.get();
+			}
+
+			if (msg.io_offset == 0)
+				prepare_write(msg);
+
+			if (msg.io_offset < msg.header_size) {
+				iov[iovcnt].iov_base = (char *)&msg.header + msg.io_offset;
+				iov[iovcnt].iov_len = msg.header_size - msg.io_offset;
+				iovcnt++;
+			}
+
+			size_t size = wire_size(msg);
+			size_t data_offset = std::max(msg.io_offset, msg.header_size);
+			if (data_offset < size) {
+				iov[iovcnt].iov_base = msg.data.get() + data_offset - msg.header_size;
+				iov[iovcnt].iov_len = size - data_offset;
+				iovcnt++;
+			}
+		}
+
+		ssize_t err = 0;
+		if (iovcnt) {
+			struct msghdr mh;
+			memset(&mh, 0, sizeof(mh));
+			mh.msg_iov = iov;
+			mh.msg_iovlen = iovcnt;
+
+			char control[CMSG_SPACE(sizeof(int))];
+			if (pass_fd >= 0) {
+				memset(control, 0, sizeof(control));
+				mh.msg_control = control;
+				mh.msg_controllen = sizeof(control);
+
+				struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+				cmsg->cmsg_level = SOL_SOCKET;
+				cmsg->cmsg_type = SCM_RIGHTS;
+				cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+				memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+			}
+
+			err = ::sendmsg(m_fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (err < 0) {
+				err = -errno;
+				if (err == -EINTR)
+					continue;
+				if (err == -EAGAIN)
+					return err;
+
+
+				LOG(ERROR) << "write_some: messages: " << num - pos <<
+					", iovecs: " << iovcnt <<
+					", error: " << err;
+				return err;
+			}
+		}
+
+		// distribute written bytes among messages in order
+		size_t written = err;
+		while (pos < num) {
+			message &msg = *msgs[pos];
+			size_t size = wire_size(msg);
+			size_t sent = std::min(written, size - std::min(msg.io_offset, size));
+
+			msg.io_offset += sent;
+			written -= sent;
+
+			if (msg.io_offset < size)
+				break;
+
+			// payload has already been placed into the ring or is passed as descriptor
+			if (msg.header.flags & (message::flag_shm | message::flag_fd))
+				msg.io_offset = msg.header_size + msg.header.size;
+
+			pos++;
+		}
+	}
+
+	return 0;
+}
+
+// Moves already received bytes from the receive buffer into the message,
+// header is always parsed from the buffer, payload is allocated as soon as header is complete.
+int worker::consume_buffered(message &msg)
+{
+	size_t avail = m_rx_end - m_rx_start;
+
+	if (msg.io_offset < msg.header_size) {
+		size_t size = std::min(avail, msg.header_size - msg.io_offset);
+		memcpy((char *)&msg.header + msg.io_offset, m_rx_buf.get() + m_rx_start, size);
+		msg.io_offset += size;
+		m_rx_start += size;
+		avail -= size;
+
+		if (msg.io_offset != msg.header_size)
+			goto out;
+
+		if (msg.header.flags & message::flag_fd) {
+			if (m_rx_fds.empty()) {
+				LOG(ERROR) << "read_some: descriptor has not been received for message: " << msg.str();
+				return -EPROTO;
+			}
+
+			msg.fd = std::move(m_rx_fds.front());
+			m_rx_fds.pop_front();
+
+			int err = 0;
+			msg.data = map_region(msg.fd.get(), msg.header.offset, msg.header.size,
+					PROT_READ | PROT_WRITE, MAP_PRIVATE, &err);
+			if (err) {
+				LOG(ERROR) << "read_some: could not map descriptor message: " << msg.str() <<
+					", offset: " << msg.header.offset <<
+					", error: " << strerror(-err) << " [" << err << "]";
+				return err;
+			}
+
+			msg.header.flags &= ~message::flag_fd;
+			msg.header.offset = 0;
+			msg.io_offset += msg.header.size;
+			goto out;
+		}
+
+		if (msg.header.flags & message::flag_shm) {
+			if (m_rx_ring)
+				msg.data = buffer(m_rx_ring->pop(msg.header.offset, msg.header.size));
+
+			if (!msg.data) {
+				LOG(ERROR) << "read_some: invalid shared memory message: " << msg.str() <<
+					", offset: " << msg.header.offset;
+				return -EPROTO;
+			}
+
+			msg.header.flags &= ~message::flag_shm;
+			msg.header.offset = 0;
+			msg.io_offset += msg.header.size;
+			goto out;
+		}
 
-		LOG(ERROR) << "could not add epoll event: " << strerror(-err);
-		std::ostringstream ss;
-		ss << "could not add epoll event: " << strerror(-err);
-		throw std::runtime_error(ss.str());
+		msg.data = buffer(msg.header.size);
 	}
-}
 
-io_scheduler::~io_scheduler()
-{
-	epoll_event ev;
-	ev.events = m_event;
-	ev.data.fd = m_fd;
-	epoll_ctl(m_efd, EPOLL_CTL_DEL, m_fd, &ev);
+	if (avail) {
+		size_t data_offset = msg.io_offset - msg.header_size;
+		size_t size = std::min(avail, (size_t)msg.header.size - data_offset);
+
+		memcpy(msg.data.get() + data_offset, m_rx_buf.get() + m_rx_start, size);
+		msg.io_offset += size;
+		m_rx_start += size;
+	}
+
+out:
+	if (m_rx_start == m_rx_end)
+		m_rx_start = m_rx_end = 0;
+
+	return 0;
 }
 
-int io_scheduler::ready(long timeout_ms, epoll_event *ev)
+ssize_t worker::read_some(message &msg)
 {
-	ribosome::timer tm;
+	size_t total = 0;
+
+	if (!m_rx_buf)
+		m_rx_buf.reset(new char[rx_buffer_size]);
 
 	while (true) {
-		memset(ev, 0, sizeof(epoll_event));
+		int err = consume_buffered(msg);
+		if (err < 0)
+			return err;
 
-		int nfds = epoll_wait(m_efd, ev, 1, timeout_ms);
-		if (nfds < 0) {
-			int err = -errno;
-			if (errno == EINTR)
-				continue;
-			if (errno == EAGAIN)
+		if (msg.io_completed())
+			break;
+
+		// receive buffer is empty at this point, payload is received directly into the message,
+		// header and small messages are received into the buffer, possibly several of them at once
+		struct iovec iov[2];
+		int iovcnt = 0;
+
+		if (msg.io_offset >= msg.header_size) {
+			size_t data_offset = msg.io_offset - msg.header_size;
+			iov[iovcnt].iov_base = msg.data.get() + data_offset;
+			iov[iovcnt].iov_len = msg.header.size - data_offset;
+			iovcnt++;
+		}
+
+		iov[iovcnt].iov_base = m_rx_buf.get();
+		iov[iovcnt].iov_len = rx_buffer_size;
+		iovcnt++;
+
+		char control[CMSG_SPACE(sizeof(int) * max_rx_fds)];
+
+		struct msghdr mh;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = iov;
+		mh.msg_iovlen = iovcnt;
+		mh.msg_control = control;
+		mh.msg_controllen = sizeof(control);
+
+		ssize_t rd = ::recvmsg(m_fd, &mh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+		if (rd == 0) {
+			LOG(ERROR) << "read_some: message: " << msg.str() <<
+				", io_offset: " << msg.io_offset <<
+				", connection has been closed";
+			return -ECONNRESET;
+		}
+
+		if (rd < 0) {
+			rd = -errno;
+			if (rd == -EAGAIN)
+				break;
+			if (rd == -EINTR)
 				continue;
 
-			LOG(ERROR) << "could not wait for epoll event: " << strerror(-err);
-			return err;
+			LOG(ERROR) << "read_some: message: " << msg.str() <<
+				", io_offset: " << msg.io_offset <<
+				", error: " << rd;
+			return rd;
 		}
 
-		if (nfds == 0)
-			return 0;
+		total += rd;
+
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
 
-		dprintf("%d: ready: efd: %d, fd: %d, events: %x, requested_event: %x\n",
-				getpid(),
-				m_efd, m_fd, ev->events, m_event);
-		if (ev->events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
-			LOG(ERROR) << "ready: efd: " << m_efd <<
-				", fd: " << m_fd <<
-				std::hex << std::setfill('0') <<
-				", events: " << ev->events <<
-				", requested_event: " << m_event;
+			size_t num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for (size_t i = 0; i < num; ++i) {
+				int fd;
+				memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+				m_rx_fds.emplace_back(fd);
+			}
+		}
+
+		if (mh.msg_flags & MSG_CTRUNC) {
+			LOG(ERROR) << "read_some: message: " << msg.str() <<
+				", received descriptors have been truncated";
+			return -EPROTO;
 		}
 
-		if (ev->events & m_event)
-			return 1;
+		size_t direct = 0;
+		if (iovcnt == 2) {
+			direct = std::min((size_t)rd, iov[0].iov_len);
+			msg.io_offset += direct;
+		}
 
-		timeout_ms -= tm.restart();
-		if (timeout_ms <= 0)
-			return -ETIMEDOUT;
+		m_rx_end = rd - direct;
 	}
+
+	dprintf("%d: message read: cmd: %d, size: %ld, data: %.*s\n",
+			getpid(), msg.header.cmd, msg.header.size, (int)msg.header.size, msg.data.get());
+
+	return total;
 }
 
+zygote::zygote(const options &opt) : m_opt(opt)
+{
+}
 
-worker::worker()
+zygote::~zygote()
 {
+	if (m_fd >= 0)
+		::close(m_fd);
+
+	// zygote exits when its socket is closed
+	if (m_pid > 0) {
+		kill(m_pid, SIGTERM);
+		waitpid(m_pid, NULL, 0);
+	}
 }
 
-worker::~worker()
+pid_t zygote::pid() const
 {
-	int status;
-	stop(&status);
+	return m_pid;
 }
 
-int worker::start(worker::callback_t callback)
+int zygote::start(worker::callback_t callback, worker::batch_callback_t batch_callback,
+		worker::stream_callback_t stream_callback)
 {
-	int err;
 	int fd[2];
 
-	err = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fd);
+	int err = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fd);
 	if (err == -1) {
 		err = -errno;
-		LOG(ERROR) << "fpool::worker::start: could not create socketpair" <<
+		LOG(ERROR) << "fpool::zygote::start: could not create socketpair" <<
 			": error: " << strerror(-err) << " [" << err << "]";
 		return err;
 	}
@@ -120,506 +2256,1292 @@ int worker::start(worker::callback_t callback)
 	m_pid = fork();
 	if (m_pid == -1) {
 		err = -errno;
-		LOG(ERROR) << "fpool::worker::start: could not fork" <<
+		LOG(ERROR) << "fpool::zygote::start: could not fork" <<
 			": error: " << strerror(-err) << " [" << err << "]";
+		::close(fd[0]);
+		::close(fd[1]);
 		return err;
 	}
 
-	m_need_exit = false;
-
-	// child process
 	if (m_pid == 0) {
-		setsid();
-
 		::close(fd[0]);
 		m_fd = fd[1];
 
-		m_epollfd = epoll_create1(EPOLL_CLOEXEC);
-		if (m_epollfd < 0) {
-			exit(-errno);
-		}
-
-
-		m_pid = getpid();
-
-		sigset_t set;
-		sigemptyset(&set);
-		sigaddset(&set, SIGTERM);
-		sigprocmask(SIG_UNBLOCK, &set, NULL);
-
-		LOG(INFO) << "worker: " << m_pid << ", need_exit: " << m_need_exit << ": starting";
-		run(callback);
-		LOG(INFO) << "worker: " << m_pid << ": exiting";
+		run(callback, batch_callback, stream_callback);
 		exit(0);
 	}
 
 	::close(fd[1]);
 	m_fd = fd[0];
 
-	m_epollfd = epoll_create1(EPOLL_CLOEXEC);
-	if (m_epollfd < 0) {
+	LOG(INFO) << "fpool::zygote::start: process " << m_pid << " has been started";
+	return 0;
+}
+
+// Worker socket and rings are passed to zygote, reply is either pid of the new process or negative error
+int zygote::spawn(spawned *sp)
+{
+	int err = worker::create_rings(m_opt, sp);
+	if (err)
+		return err;
+
+	int fd[2];
+	err = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fd);
+	if (err == -1) {
 		err = -errno;
-		LOG(ERROR) << "fpool::worker::start: could not create epoll file descriptor" <<
+		LOG(ERROR) << "fpool::zygote::spawn: could not create socketpair" <<
 			": error: " << strerror(-err) << " [" << err << "]";
 		return err;
 	}
 
-	m_io_thread.reset(new std::thread(std::bind(&worker::io, this)));
+	sp->fd = descriptor(fd[0]);
+	descriptor child(fd[1]);
 
-	LOG(INFO) << "fpool::worker::start: process " << m_pid << " has been started";
+	int fds[3] = {child.get(), -1, -1};
+	int num = 1;
+	if (sp->tx_ring) {
+		fds[num++] = sp->tx_ring->fd();
+		fds[num++] = sp->rx_ring->fd();
+	}
+
+	int32_t req = num;
+	struct iovec iov;
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+
+	char control[CMSG_SPACE(sizeof(fds))];
+	memset(control, 0, sizeof(control));
+
+	struct msghdr mh;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control;
+	mh.msg_controllen = CMSG_SPACE(sizeof(int) * num);
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num);
+
+	std::unique_lock<std::mutex> guard(m_lock);
+
+	ssize_t ret;
+	do {
+		ret = ::sendmsg(m_fd, &mh, MSG_NOSIGNAL);
+	} while (ret < 0 && errno == EINTR);
+
+	int32_t reply = 0;
+	if (ret == (ssize_t)sizeof(req)) {
+		do {
+			ret = ::recv(m_fd, &reply, sizeof(reply), 0);
+		} while (ret < 0 && errno == EINTR);
+	}
+	guard.unlock();
+
+	if (ret != (ssize_t)sizeof(reply)) {
+		err = ret < 0 ? -errno : -ECONNRESET;
+		LOG(ERROR) << "fpool::zygote::spawn: zygote " << m_pid << " has failed" <<
+			": error: " << strerror(-err) << " [" << err << "]";
+		return err;
+	}
+
+	if (reply < 0) {
+		LOG(ERROR) << "fpool::zygote::spawn: zygote " << m_pid << " could not start worker" <<
+			": error: " << strerror(-reply) << " [" << reply << "]";
+		return reply;
+	}
+
+	sp->pid = reply;
 	return 0;
 }
 
-void worker::close()
+void zygote::run(worker::callback_t callback, worker::batch_callback_t batch_callback,
+		worker::stream_callback_t stream_callback)
 {
-	if (m_fd >= 0) {
-		::close(m_fd);
-		m_fd = -1;
+	while (true) {
+		int32_t req;
+		struct iovec iov;
+		iov.iov_base = &req;
+		iov.iov_len = sizeof(req);
+
+		char control[CMSG_SPACE(sizeof(int) * 3)];
+
+		struct msghdr mh;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = control;
+		mh.msg_controllen = sizeof(control);
+
+		ssize_t ret = ::recvmsg(m_fd, &mh, MSG_CMSG_CLOEXEC);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		// controller has gone
+		if (ret <= 0)
+			return;
+
+		std::vector<descriptor> fds;
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+
+			size_t num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for (size_t i = 0; i < num; ++i) {
+				int fd;
+				memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+				fds.emplace_back(fd);
+			}
+		}
+
+		int32_t reply = -EPROTO;
+		if ((size_t)req == fds.size() && (req == 1 || req == 3)) {
+			// new process becomes a sibling of the zygote
+			pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, NULL);
+			if (pid == 0) {
+				::close(m_fd);
+
+				worker w(NULL, m_opt);
+				if (fds.size() == 3) {
+					w.m_tx_ring = std::make_shared<shm_ring>();
+					w.m_rx_ring = std::make_shared<shm_ring>();
+
+					int err = w.m_tx_ring->attach(fds[1].release(), m_opt.shm_ring_size);
+					if (!err)
+						err = w.m_rx_ring->attach(fds[2].release(), m_opt.shm_ring_size);
+					if (err)
+						exit(err);
+				}
+
+				w.run_child(fds[0].release(), callback, batch_callback, stream_callback);
+			}
+
+			reply = pid < 0 ? -errno : pid;
+		}
+
+		fds.clear();
+
+		do {
+			ret = ::send(m_fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+		} while (ret < 0 && errno == EINTR);
+		if (ret < 0)
+			return;
 	}
-	if (m_epollfd >= 0) {
-		::close(m_epollfd);
-		m_epollfd = -1;
+}
+
+
+static options size_options(int size)
+{
+	options opt;
+	opt.workers = size;
+	return opt;
+}
+
+// returns -1 if node is not known
+static int cpu_node(int cpu)
+{
+	std::ostringstream ss;
+	ss << "/sys/devices/system/cpu/cpu" << cpu;
+
+	DIR *dir = opendir(ss.str().c_str());
+	if (!dir)
+		return -1;
+
+	int node = -1;
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL) {
+		if (sscanf(ent->d_name, "node%d", &node) == 1)
+			break;
 	}
 
-	if (m_io_thread) {
-		m_need_exit = true;
-		m_io_thread->join();
-		m_io_thread.reset();
+	closedir(dir);
+	return node;
+}
+
+struct loop_affinity {
+	cpu_set_t loop;
+	cpu_set_t workers;
+};
+
+// CPU sets of IO loops and their workers according to @options::affinity, empty if loops are not pinned
+static std::vector<loop_affinity> loop_cpus(const options &opt, int loops)
+{
+	std::vector<loop_affinity> sets;
+	if (opt.affinity == options::affinity_none)
+		return sets;
+
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+		int err = -errno;
+		LOG(ERROR) << "fpool::controller: could not get process affinity, IO loops are not pinned" <<
+			": error: " << strerror(-err) << " [" << err << "]";
+		return sets;
+	}
+
+	std::vector<int> cpus = opt.affinity_cpus;
+	if (cpus.empty()) {
+		std::vector<int> nodes;
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (!CPU_ISSET(cpu, &allowed))
+				continue;
+
+			// one CPU per node, so that loops are spread over nodes
+			if (opt.affinity == options::affinity_numa_node) {
+				int node = cpu_node(cpu);
+				if (std::find(nodes.begin(), nodes.end(), node) != nodes.end())
+					continue;
+				nodes.push_back(node);
+			}
+
+			cpus.push_back(cpu);
+		}
+	}
+
+	if (cpus.empty())
+		return sets;
+
+	for (int i = 0; i < loops; ++i) {
+		int cpu = cpus[i % cpus.size()];
+
+		// all allowed CPUs if node is not known
+		cpu_set_t node_set;
+		CPU_ZERO(&node_set);
+		CPU_SET(cpu, &node_set);
+
+		int node = cpu_node(cpu);
+		for (int c = 0; c < CPU_SETSIZE; ++c) {
+			if (CPU_ISSET(c, &allowed) && (node < 0 || cpu_node(c) == node))
+				CPU_SET(c, &node_set);
+		}
+
+		loop_affinity la;
+		la.workers = node_set;
+		if (opt.affinity == options::affinity_numa_node) {
+			la.loop = node_set;
+		} else {
+			CPU_ZERO(&la.loop);
+			CPU_SET(cpu, &la.loop);
+		}
+
+		sets.push_back(la);
 	}
+
+	return sets;
 }
 
-int worker::stop(int *status)
+static void add_metrics(worker_metrics *to, const worker_metrics &from)
 {
-	m_need_exit = true;
+	to->queue_wait.merge(from.queue_wait);
+	to->service.merge(from.service);
+	to->latency.merge(from.latency);
+
+	to->requests += from.requests;
+	to->request_bytes += from.request_bytes;
+	to->replies += from.replies;
+	to->reply_bytes += from.reply_bytes;
+	to->queued += from.queued;
+	to->in_flight += from.in_flight;
+	to->timeouts += from.timeouts;
+	to->restarts += from.restarts;
+}
 
-	if (m_pid < 0) {
-		*status = 0;
-		return 0;
+static void fail_queued(std::deque<worker::job> &queue)
+{
+	for (auto &j: queue) {
+		message reply = message::copy_header(j.msg);
+		reply.header.status = -ECONNRESET;
+		j.complete(reply);
 	}
+	queue.clear();
+}
 
-	LOG(INFO) << "fpool::worker::stop: sendig SIGTERM to pid " << m_pid;
-	int err = kill(m_pid, SIGTERM);
+// pids are positive, so this value marks stop timers in the process wait epoll
+static const uint64_t wait_timer_event = ~0ULL;
+
+controller::controller(int size, worker::callback_t callback)
+	: controller(size_options(size), callback)
+{
+}
+
+controller::controller(const options &opt, worker::callback_t callback, worker::batch_callback_t batch_callback,
+		worker::stream_callback_t stream_callback)
+	: m_opt(opt)
+	, m_rejected(0)
+	, m_rejected_bytes(0)
+	, m_waited(0)
+	, m_timed_out(0)
+	, m_callback(callback)
+	, m_batch_callback(batch_callback)
+	, m_stream_callback(stream_callback)
+{
+	m_shared_queue.queue.configure(m_opt);
+
+	m_wait_epollfd = epoll_create1(EPOLL_CLOEXEC);
+	m_wait_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_wait_epollfd < 0 || m_wait_wakefd < 0) {
+		int err = -errno;
+		std::ostringstream ss;
+		ss << "could not create process wait descriptors, error: " << strerror(-err) << " [" << err << "]";
+		throw std::runtime_error(ss.str());
+	}
+
+	// processes are registered with their pids, zero marks wakeup eventfd
+	int err = epoll_add(m_wait_epollfd, m_wait_wakefd, EPOLLIN, NULL);
 	if (err < 0) {
+		std::ostringstream ss;
+		ss << "could not register process wait eventfd, error: " << strerror(-err) << " [" << err << "]";
+		throw std::runtime_error(ss.str());
+	}
+
+	ribosome::expiration::options topt;
+	topt.external = true;
+	m_stop_timers.reset(new ribosome::expiration(topt));
+
+	epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = wait_timer_event;
+	if (epoll_ctl(m_wait_epollfd, EPOLL_CTL_ADD, m_stop_timers->fd(), &ev) < 0) {
 		err = -errno;
-		LOG(ERROR) << "fpool::worker::stop: could not send SIGTERM to pid " << m_pid <<
-			", error: " << strerror(-err) << " [" << err << "]";
-		return err;
+		std::ostringstream ss;
+		ss << "could not register process stop timers, error: " << strerror(-err) << " [" << err << "]";
+		throw std::runtime_error(ss.str());
 	}
 
-	pid_t pid = 0;
-	for (int i = 0; i < 10; ++i) {
-		pid = waitpid(m_pid, status, WNOHANG);
-		if (pid < 0) {
-			err = -errno;
+	if (m_opt.prefork) {
+		m_zygote.reset(new zygote(m_opt));
 
-			LOG(ERROR) << "fpool::worker::stop: could not wait1 for to pid " << m_pid <<
-				", error: " << strerror(-err) << " [" << err << "]";
-			return err;
+		int err = m_zygote->start(callback, batch_callback, stream_callback);
+		if (err < 0) {
+			std::ostringstream ss;
+			ss << "could not start zygote process, error: " << strerror(-err) << " [" << err << "]";
+			throw std::runtime_error(ss.str());
 		}
+	}
 
-		if (pid > 0)
-			break;
-
-		usleep(10000);
+	if (m_opt.max_workers > 0) {
+		m_opt.min_workers = std::max(m_opt.min_workers, 1);
+		m_opt.max_workers = std::max(m_opt.max_workers, m_opt.min_workers);
+		m_opt.workers = std::min(std::max(m_opt.workers, m_opt.min_workers), m_opt.max_workers);
 	}
 
-	if (pid == 0) {
-		LOG(ERROR) << "fpool::worker::stop: SIGTERM has been ignored, sending SIGKILL to pid " << m_pid;
+	int loops = m_opt.io_threads;
+	if (loops <= 0)
+		loops = m_opt.max_workers > 0 ? m_opt.max_workers : m_opt.workers;
+	std::vector<loop_affinity> cpus = loop_cpus(m_opt, loops);
+	for (int i = 0; i < loops; ++i) {
+		m_loops.emplace_back(new io_loop());
 
-		err = kill(m_pid, SIGKILL);
+		int err = cpus.empty() ? m_loops.back()->start() : m_loops.back()->start(&cpus[i].loop, &cpus[i].workers);
 		if (err < 0) {
-			err = -errno;
-			LOG(ERROR) << "fpool::worker::stop: could not send SIGKILL to pid " << m_pid <<
-				", error: " << strerror(-err) << " [" << err << "]";
-			return err;
+			std::ostringstream ss;
+			ss << "could not start IO loop, error: " << strerror(-err) << " [" << err << "]";
+			throw std::runtime_error(ss.str());
 		}
+	}
 
-		pid = waitpid(m_pid, status, 0);
-		if (pid <= 0) {
-			err = -errno;
-			LOG(ERROR) << "fpool::worker::stop: could not wait2 for pid " << m_pid <<
-				", error: " << strerror(-err) << " [" << err << "]";
-			return err;
+	for (int i = 0; i < m_opt.workers; ++i) {
+		int err = add_worker();
+		if (err < 0) {
+			LOG(ERROR) << "could not start new worker thread, error: " << strerror(-err) << " [" << err << "]";
+
+			std::ostringstream ss;
+			ss << "could not start new worker thread, error: " << strerror(-err) << " [" << err << "]";
+			throw std::runtime_error(ss.str());
+		}
+	}
+
+	fill_standby();
+	m_next_resize = std::chrono::steady_clock::now() + std::chrono::milliseconds(m_opt.scale_interval);
+
+	// processes started above are already watched, their termination will be noticed by this thread
+	m_wait_thread = std::thread(std::bind(&controller::wait_for_children, this));
+}
+
+controller::~controller()
+{
+	if (m_wait_thread.joinable()) {
+		m_wait_need_exit = true;
+		wake_wait_thread();
+
+		m_wait_thread.join();
+	}
+
+	// queued requests are completed before workers are stopped, stopping fails the sent ones
+	std::deque<worker::job> queue;
+	std::unique_lock<std::mutex> sguard(m_shared_queue.lock);
+	m_shared_queue.queue.take(&queue);
+	m_shared_queue.bytes = 0;
+	sguard.unlock();
+	fail_queued(queue);
+
+	for (auto &r: m_retiring) {
+		r.w->take_queue(&queue);
+		fail_queued(queue);
+	}
+	for (auto &w: m_workers) {
+		w->take_queue(&queue);
+		fail_queued(queue);
+	}
+
+	// retired workers are stopped by their destructors
+	m_retiring.clear();
+
+	for (auto &w: m_workers) {
+		int status;
+		w->stop(&status);
+	}
+
+	// removed workers have already been asked to exit and are not waited for any longer
+	for (auto &p: m_stopping) {
+		kill(p.first, SIGKILL);
+		waitpid(p.first, NULL, 0);
+	}
+	m_stopping.clear();
+	m_stop_timers.reset();
+
+	// every request has been completed above and has removed its deadline timer
+	m_expiration.reset();
+
+	for (auto &sp: m_standby) {
+		kill(sp.pid, SIGTERM);
+		waitpid(sp.pid, NULL, 0);
+	}
+	m_standby.clear();
+
+	m_watched.clear();
+	if (m_wait_epollfd >= 0)
+		::close(m_wait_epollfd);
+	if (m_wait_wakefd >= 0)
+		::close(m_wait_wakefd);
+}
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+void controller::watch(pid_t pid)
+{
+	descriptor pidfd(syscall(SYS_pidfd_open, pid, 0));
+	if (pidfd) {
+		epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u64 = pid;
+
+		if (epoll_ctl(m_wait_epollfd, EPOLL_CTL_ADD, pidfd.get(), &ev) < 0)
+			pidfd.reset();
+	}
+
+	std::lock_guard<std::mutex> guard(m_watch_lock);
+	if (!pidfd)
+		m_polled++;
+	m_watched[pid] = std::move(pidfd);
+}
+
+void controller::unwatch(pid_t pid)
+{
+	std::lock_guard<std::mutex> guard(m_watch_lock);
+	auto it = m_watched.find(pid);
+	if (it == m_watched.end())
+		return;
+
+	// closing pidfd removes it from epoll
+	if (!it->second)
+		m_polled--;
+	m_watched.erase(it);
+}
+
+int controller::spawn(spawned *sp)
+{
+	if (m_zygote) {
+		int err = m_zygote->spawn(sp);
+		if (!err) {
+			watch(sp->pid);
+			return 0;
 		}
+
+		LOG(ERROR) << "fpool::controller::spawn: could not start worker via zygote, falling back to fork" <<
+			": error: " << strerror(-err) << " [" << err << "]";
+		*sp = spawned();
 	}
 
-	close();
-	LOG(INFO) << "fpool::worker::stop: process " << m_pid << " has been stopped";
-	m_pid = -1;
+	int err = worker::fork_process(m_opt, m_callback, m_batch_callback, m_stream_callback, sp);
+	if (err)
+		return err;
+
+	watch(sp->pid);
 	return 0;
 }
 
-int worker::restart(worker::callback_t callback)
+int controller::add_worker()
 {
-	int status;
-	int err = stop(&status);
-	if (err) {
-		if (err != -ESRCH)
-			return err;
+	worker::shared_queue *shared = NULL;
+	if (m_opt.dispatch == options::dispatch_shared_queue)
+		shared = &m_shared_queue;
+
+	// workers are stopped and started, so their number does not tell which loop is the least used one
+	std::vector<size_t> used(m_loops.size());
+	std::unique_lock<std::mutex> guard(m_lock);
+	for (auto &w: m_workers) {
+		for (size_t i = 0; i < m_loops.size(); ++i) {
+			if (w->loop() == m_loops[i].get())
+				used[i]++;
+		}
 	}
+	guard.unlock();
 
-	return start(callback);
-}
+	size_t loop = std::min_element(used.begin(), used.end()) - used.begin();
+	std::unique_ptr<worker> w(new worker(m_loops[loop].get(), m_opt, shared, &m_admission));
 
-pid_t worker::pid() const
-{
-	return m_pid;
-}
+	spawned sp;
+	bool standby = take_standby(&sp);
+	int err = 0;
+	if (!standby)
+		err = spawn(&sp);
+	if (!err)
+		err = w->start(std::move(sp));
+	if (err < 0)
+		return err;
 
-size_t worker::queue_size() const
-{
-	return m_queue.size();
+	guard.lock();
+	m_workers.emplace_back(std::move(w));
+	guard.unlock();
+
+	if (standby)
+		fill_standby();
+	return 0;
 }
 
-void worker::queue(const message &msg, completion_t complete)
+void controller::remove_worker(std::unique_ptr<worker> &&w)
 {
-	std::unique_lock<std::mutex> lk(m_lock);
-	m_queue.push_back(std::pair<message, completion_t>(msg, complete));
-	m_wait.notify_one();
+	// process is reaped by the wait loop when its pidfd becomes readable,
+	// it is killed if it has not exited @options::kill_timeout after SIGTERM
+	pid_t pid = w->pid();
+	watch(pid);
+
+	if (w->terminate() == 0) {
+		m_stopping[pid] = m_stop_timers->insert(
+				std::chrono::steady_clock::now() + std::chrono::milliseconds(m_opt.kill_timeout),
+				[this, pid] () {
+					if (m_stopping.find(pid) == m_stopping.end())
+						return;
+
+					LOG(ERROR) << "fpool::controller::remove_worker: SIGTERM has been ignored, "
+						"sending SIGKILL to pid " << pid;
+					kill(pid, SIGKILL);
+				});
+	}
+
+	worker_metrics m;
+	w->metrics(&m);
+	// queued requests are redispatched to other workers below
+	m.queued = m.in_flight = 0;
+	std::unique_lock<std::mutex> guard(m_lock);
+	add_metrics(&m_removed, m);
+	guard.unlock();
+
+	std::deque<worker::job> queue;
+	w->take_queue(&queue);
+	for (auto &j: queue) {
+		redispatch(j);
+	}
 }
 
-// runs in forked child
-void worker::run(callback_t callback)
+void controller::resize()
 {
-	while (!m_need_exit) {
-		int err;
-		message msg;
+	auto now = std::chrono::steady_clock::now();
+	if (m_opt.max_workers <= 0 || now < m_next_resize)
+		return;
 
-		while (!msg.io_completed() && !m_need_exit) {
-			err = read(msg, -1);
-			if (err) {
-				LOG(ERROR) << "worker: " << m_pid << ", read error: " << err << ", exiting";
-				exit(err);
-			}
-		}
+	m_next_resize = now + std::chrono::milliseconds(m_opt.scale_interval);
 
-		LOG(INFO) << "worker: " << m_pid << ": job: " << msg.str();
+	uint64_t wait = 0;
+	std::unique_lock<std::mutex> guard(m_lock);
+	for (auto &w: m_workers) {
+		wait = std::max(wait, w->take_queue_wait());
+	}
 
-		message reply = callback(msg);
-		LOG(INFO) << "worker: " << m_pid << ": job: " << msg.str() << " -> " << reply.str();
+	int size = m_workers.size();
+	if (wait > (uint64_t)m_opt.scale_up_wait * 1000 && size < m_opt.max_workers) {
+		guard.unlock();
 
-		while (!reply.io_completed() && !m_need_exit) {
-			err = write(reply, -1);
-			if (err) {
-				LOG(ERROR) << "worker: " << m_pid << ", write error: " << err << ", exiting";
-				exit(err);
-			}
+		if (m_opt.scale_up_max_load > 0) {
+			double load;
+			long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+			if (getloadavg(&load, 1) == 1 && cpus > 0 && load / cpus > m_opt.scale_up_max_load)
+				return;
 		}
-	}
-}
 
-void worker::io()
-{
-	int err = raw_io();
+		int err = add_worker();
+		if (err < 0) {
+			LOG(ERROR) << "fpool::controller::resize: could not start new worker: " <<
+				strerror(-err) << " [" << err << "]";
+			return;
+		}
 
-	// there was an IO error, protocol is already broken,
-	// worker can not recover and should be restarted
-	if (err < 0) {
-		LOG(ERROR) << "worker: " << m_pid << ", IO error: " << err << ", killing itself";
-		kill(m_pid, SIGTERM);
+		LOG(INFO) << "fpool::controller::resize: queue wait: " << wait << " usecs, workers: " << size + 1;
 		return;
 	}
-}
 
-int worker::raw_io()
-{
-	long timeout = 100;
-	int err = 0;
+	if (size <= m_opt.min_workers)
+		return;
 
-	while (!m_need_exit) {
-		std::unique_lock<std::mutex> lk(m_lock);
-		if (m_queue.empty()) {
-			m_wait.wait_for(lk, std::chrono::milliseconds(100), [&] () {return !m_queue.empty();});
-		}
+	// worker is removed under the lock, so that nothing could be queued to it
+	auto idle = std::chrono::milliseconds(m_opt.scale_down_idle);
+
+	// shared queue is not empty when the worker notified about new requests has not pulled them yet,
+	// retiring it would leave them without anyone who is woken up to process them
+	if (m_opt.dispatch == options::dispatch_shared_queue) {
+		std::lock_guard<std::mutex> sguard(m_shared_queue.lock);
+		if (!m_shared_queue.queue.empty())
+			return;
+	}
 
-		if (m_queue.empty()) {
+	for (auto it = m_workers.begin(); it != m_workers.end(); ++it) {
+		auto &w = *it;
+		if (w->queue_size() || w->in_flight() || now - w->last_active() < idle)
 			continue;
-		}
 
-		std::pair<message, worker::completion_t> p(m_queue.front());
-		m_queue.pop_front();
-		lk.unlock();
+		std::unique_ptr<worker> victim(std::move(w));
+		victim->retire(std::bind(&controller::wake_wait_thread, this));
+		m_workers.erase(it);
+		guard.unlock();
 
-		message &msg = p.first;
-		while (!msg.io_completed() && !m_need_exit) {
-			err = write(msg, timeout);
-			if (err < 0) {
-				message reply = message::copy_header(msg);
-				reply.header.status = err;
-				p.second(reply);
-				return err;
-			}
-		}
+		LOG(INFO) << "fpool::controller::resize: stopping idle worker " << victim->pid() <<
+			", workers: " << size - 1;
 
-		if (m_need_exit)
-			break;
+		// process must not be reaped as a crashed one while it completes its requests,
+		// it is watched again when it is sent SIGTERM
+		unwatch(victim->pid());
 
-		// as soon as write completed we do not write next message to the worker,
-		// instead wait for reply
-		message reply;
-		while (!reply.io_completed() && !m_need_exit) {
-			err = read(reply, timeout);
-			if (err < 0) {
-				reply = message::copy_header(msg);
-				reply.header.status = err;
-				p.second(reply);
-				return err;
-			}
+		// requests could have been pulled from the shared queue before worker has been retired,
+		// worker is removed when they have been completed
+		retiring_worker r;
+		r.w = std::move(victim);
+		r.deadline = now + std::chrono::milliseconds(m_opt.kill_timeout);
+		m_retiring.emplace_back(std::move(r));
+		return;
+	}
+}
+
+long controller::remove_retired()
+{
+	auto now = std::chrono::steady_clock::now();
+	long timeout = -1;
+
+	for (auto it = m_retiring.begin(); it != m_retiring.end();) {
+		if (it->w->in_flight() && now < it->deadline) {
+			long msecs = std::chrono::duration_cast<std::chrono::milliseconds>(it->deadline - now).count() + 1;
+			timeout = timeout < 0 ? msecs : std::min(timeout, msecs);
+			++it;
+			continue;
 		}
-		LOG(INFO) << "going to call completion callback with reply: " << reply.str();
-		p.second(reply);
-		LOG(INFO) << "completed completion callback with reply: " << reply.str();
+
+		std::unique_ptr<worker> w(std::move(it->w));
+		it = m_retiring.erase(it);
+		remove_worker(std::move(w));
 	}
 
-	return 0;
+	return timeout;
 }
 
-ssize_t worker::write_raw(const char *ptr, size_t size)
+void controller::wake_wait_thread()
 {
-	size_t written = 0;
-	while (written < size) {
-		ssize_t err = ::send(m_fd, ptr + written, size - written, 0);
-		if (err <= 0) {
-			err = -errno;
-			LOG(ERROR) << "write_raw: size: " << size <<
-				", written: " << written <<
-				", error: " << err;
+	uint64_t val = 1;
+	ssize_t err = ::write(m_wait_wakefd, &val, sizeof(val));
+	(void) err;
+}
 
-			if (err == -EAGAIN)
-				return written;
+void controller::fill_standby()
+{
+	while (true) {
+		std::unique_lock<std::mutex> guard(m_standby_lock);
+		if (m_standby.size() >= m_opt.standby)
+			break;
+		guard.unlock();
 
-			return err;
+		spawned sp;
+		int err = spawn(&sp);
+		if (err) {
+			LOG(ERROR) << "fpool::controller::fill_standby: could not start standby process" <<
+				": error: " << strerror(-err) << " [" << err << "]";
+			break;
 		}
 
-		written += err;
+		guard.lock();
+		m_standby.emplace_back(std::move(sp));
 	}
+}
+
+bool controller::take_standby(spawned *sp)
+{
+	std::unique_lock<std::mutex> guard(m_standby_lock);
+	if (m_standby.empty())
+		return false;
 
-	return written;
+	*sp = std::move(m_standby.front());
+	m_standby.pop_front();
+	return true;
 }
-int worker::write(message &msg, long timeout)
+
+bool controller::drop_standby(pid_t pid)
 {
-	ssize_t err;
-	char *ptr;
-	epoll_event ev;
+	std::unique_lock<std::mutex> guard(m_standby_lock);
+	auto it = std::find_if(m_standby.begin(), m_standby.end(), [=] (const spawned &sp) {
+				return sp.pid == pid;
+			});
+	if (it == m_standby.end())
+		return false;
+
+	m_standby.erase(it);
+	return true;
+}
 
-	io_scheduler send(m_epollfd, m_fd, EPOLLOUT);
-	err = send.ready(timeout, &ev);
-	if (err < 0) {
-		if (ev.events & (EPOLLHUP | EPOLLERR))
-			return -EIO;
+respawn_stats controller::respawns()
+{
+	std::unique_lock<std::mutex> guard(m_standby_lock);
+	return m_respawn;
+}
 
-		return err;
+void controller::schedule(const message &msg, worker::completion_t complete)
+{
+	schedule(msg.clone(), complete);
+}
+
+void controller::schedule(message &&msg, worker::completion_t complete)
+{
+	worker::job j(std::move(msg), std::move(complete));
+	int err = dispatch(j, true);
+	if (err == -EAGAIN)
+		reject(j.msg);
+	if (err) {
+		message reply = message::copy_header(j.msg);
+		reply.header.status = err;
+		j.complete(reply);
 	}
+}
 
-	if (err == 0)
-		return 0;
+int controller::try_schedule(message &&msg, worker::completion_t complete)
+{
+	worker::job j(std::move(msg), std::move(complete));
+	int err = dispatch(j, true);
+	if (err == -EAGAIN)
+		reject(j.msg);
+	if (err)
+		msg = std::move(j.msg);
+
+	return err;
+}
 
-	if (msg.io_offset < msg.header_size) {
-		ptr = (char *)&msg.header;
-		ptr += msg.io_offset;
-		err = write_raw(ptr, msg.header_size - msg.io_offset);
-		if (err < 0)
-			return err;
+int controller::schedule_wait(message &&msg, worker::completion_t complete, long timeout)
+{
+	worker::job j(std::move(msg), std::move(complete));
+	int err = dispatch(j, true);
+	if (err == -EAGAIN) {
+		m_waited++;
+
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+		// completions notify waiters after pending counters have been updated,
+		// which can not happen between the check and wait, since notification takes this lock
+		std::unique_lock<std::mutex> guard(m_admission.lock);
+		m_admission.waiters++;
+		while ((err = dispatch(j, true)) == -EAGAIN) {
+			if (m_admission.cv.wait_until(guard, deadline) == std::cv_status::timeout) {
+				err = dispatch(j, true);
+				break;
+			}
+		}
+		m_admission.waiters--;
 
-		msg.io_offset += err;
+		if (err == -EAGAIN) {
+			m_timed_out++;
+			reject(j.msg);
+			err = -ETIMEDOUT;
+		}
 	}
 
-	size_t data_offset = msg.io_offset - msg.header_size;
-	ptr = msg.data.get() + data_offset;
-	size_t size = msg.header.size - data_offset;
-	err = write_raw(ptr, size);
-	if (err < 0)
-		return err;
+	if (err)
+		msg = std::move(j.msg);
 
-	msg.io_offset += err;
-
-	return 0;
+	return err;
 }
 
-
-ssize_t worker::read_raw(char *ptr, size_t size)
+std::vector<priority_stats> controller::priorities()
 {
-	size_t already_read = 0;
-	ssize_t err;
+	std::vector<priority_stats> stats(message::priorities);
 
-	while (already_read < size) {
-		err = ::recv(m_fd, ptr + already_read, size - already_read, 0);
-		if (err <= 0) {
-			err = -errno;
+	std::unique_lock<std::mutex> sguard(m_shared_queue.lock);
+	for (int prio = 0; prio < message::priorities; ++prio) {
+		stats[prio].queued = m_shared_queue.queue.size(prio);
+	}
+	sguard.unlock();
 
-			LOG(ERROR) << "read_raw: size: " << size <<
-				", already_read: " << already_read <<
-				", error: " << err;
+	std::lock_guard<std::mutex> guard(m_lock);
+	for (auto &w: m_workers) {
+		w->priority_counters(&stats);
+	}
 
-			if (err == 0)
-				return -ECONNRESET;
+	return stats;
+}
 
-			if (err == -EAGAIN)
-				return already_read;
+metrics_snapshot controller::metrics()
+{
+	metrics_snapshot ms;
 
-			return err;
-		}
+	std::unique_lock<std::mutex> guard(m_lock);
+	ms.workers.resize(m_workers.size());
+	for (size_t i = 0; i < m_workers.size(); ++i) {
+		m_workers[i]->metrics(&ms.workers[i]);
+	}
+	ms.total = m_removed;
+	guard.unlock();
 
-		already_read += err;
+	for (auto &w: ms.workers) {
+		add_metrics(&ms.total, w);
 	}
 
-	return already_read;
+	ms.total.pid = -1;
+	return ms;
 }
-int worker::read(message &msg, long timeout)
-{
-	ssize_t err;
-	char *ptr;
-	epoll_event ev;
 
-	io_scheduler recv(m_epollfd, m_fd, EPOLLIN);
-	err = recv.ready(timeout, &ev);
-	if (err < 0) {
-		if (ev.events & (EPOLLHUP | EPOLLERR))
-			return -EIO;
+admission_stats controller::admission() const
+{
+	admission_stats st;
+	st.rejected = m_rejected;
+	st.rejected_bytes = m_rejected_bytes;
+	st.waited = m_waited;
+	st.timed_out = m_timed_out;
+	return st;
+}
 
-		return err;
+// Requests which have already been accepted are not checked against limits
+void controller::redispatch(worker::job &j)
+{
+	int err = dispatch(j, false);
+	if (err) {
+		message reply = message::copy_header(j.msg);
+		reply.header.status = err;
+		j.complete(reply);
 	}
+}
 
-	if (err == 0)
-		return 0;
-
-	if (msg.io_offset < msg.header_size) {
-		ptr = (char *)&msg.header;
-		ptr += msg.io_offset;
-		err = read_raw(ptr, msg.header_size - msg.io_offset);
-		if (err < 0)
-			return err;
+bool controller::over_limit(size_t pending, uint64_t bytes, uint64_t size, size_t limit, uint64_t bytes_limit) const
+{
+	if (limit && pending + 1 > limit)
+		return true;
 
-		msg.io_offset += err;
+	if (bytes_limit && pending && bytes + size > bytes_limit)
+		return true;
 
-		if (err == 0 && (ev.events & (EPOLLHUP | EPOLLERR)))
-			return -EIO;
+	return false;
+}
 
-		if (msg.io_offset != msg.header_size)
-			return 0;
-	}
+void controller::reject(const message &msg)
+{
+	m_rejected++;
+	m_rejected_bytes += msg.header.size;
+}
 
-	if (!msg.data) {
-		msg.data.reset(new char[msg.header.size], array_deleter<char>());
+void controller::schedule_stream(message &&head, worker::stream_source_t source,
+		worker::completion_t chunk, worker::completion_t complete)
+{
+	worker::job j(std::move(head), std::move(complete));
+	j.stream = std::make_shared<worker::stream_handlers>();
+	j.stream->source = std::move(source);
+	j.stream->chunk = std::move(chunk);
+
+	int err = dispatch(j, true);
+	if (err == -EAGAIN)
+		reject(j.msg);
+	if (err) {
+		message reply = message::copy_header(j.msg);
+		reply.header.status = err;
+		j.complete(reply);
 	}
+}
 
-	size_t data_offset = msg.io_offset - msg.header_size;
-	ptr = msg.data.get() + data_offset;
-	size_t size = msg.header.size - data_offset;
-
-	err = read_raw(ptr, size);
-	if (err < 0)
-		return err;
+// Promise is shared with the completion, which only moves the reply into its future state.
+std::future<message> controller::schedule(message &&msg)
+{
+	auto promise = std::make_shared<std::promise<message>>();
+	auto future = promise->get_future();
 
-	msg.io_offset += err;
+	schedule(std::move(msg), [promise] (message &reply) {
+				promise->set_value(std::move(reply));
+			});
+	return future;
+}
 
-	dprintf("%d: message read: cmd: %d, size: %ld, data: %.*s\n",
-			getpid(), msg.header.cmd, msg.header.size, (int)msg.header.size, msg.data.get());
+std::future<message> controller::schedule(message &&msg, worker::deadline_t deadline)
+{
+	auto promise = std::make_shared<std::promise<message>>();
+	auto future = promise->get_future();
 
-	if (err == 0 && (ev.events & (EPOLLHUP | EPOLLERR)))
-		return -EIO;
-	return 0;
+	schedule(std::move(msg), deadline, [promise] (message &reply) {
+				promise->set_value(std::move(reply));
+			});
+	return future;
 }
 
-
-controller::controller(int size, worker::callback_t callback)
-	: m_callback(callback)
-	, m_wait_thread(std::bind(&controller::wait_for_children, this))
+// Completion state shared by a request scheduled with a deadline and its timer, protected by @lock.
+// There is only one timer armed at a time: it completes the request with -ETIMEDOUT at the deadline
+// and is armed again to check sent requests @options::kill_timeout later if the worker has not completed it.
+struct deadline_request {
+	std::mutex lock;
+	expiration::token_t timer;
+	bool armed = false;
+	// user completion has been called
+	bool completed = false;
+	// worker has completed the job
+	bool done = false;
+	message::header_t hdr;
+	worker::completion_t complete;
+};
+
+void controller::schedule(message &&msg, worker::deadline_t deadline, worker::completion_t complete)
 {
-	m_workers.resize(size);
+	std::unique_lock<std::mutex> guard(m_lock);
+	if (!m_expiration) {
+		expiration::options opt;
+		opt.backend = expiration::backend_wheel;
+		opt.steady = true;
+		m_expiration.reset(new expiration(opt));
+	}
+	expiration *ex = m_expiration.get();
+	guard.unlock();
+
+	auto req = std::make_shared<deadline_request>();
+	req->hdr = msg.header;
+	req->complete = std::move(complete);
+
+	// expired request is dropped by the worker when it is taken from the queue
+	auto kill_timeout = std::chrono::milliseconds(m_opt.kill_timeout);
+	std::unique_lock<std::mutex> rguard(req->lock);
+	req->armed = true;
+	req->timer = ex->insert(deadline, [this, ex, req, deadline, kill_timeout] () {
+				std::unique_lock<std::mutex> guard(req->lock);
+				if (req->done)
+					return;
+
+				req->completed = true;
+				req->timer = ex->insert(deadline + kill_timeout, [this, req] () {
+							std::unique_lock<std::mutex> guard(req->lock);
+							req->armed = false;
+							if (req->done)
+								return;
+							guard.unlock();
+
+							check_deadlines();
+						});
+				guard.unlock();
+
+				message reply;
+				reply.header = req->hdr;
+				reply.header.size = 0;
+				reply.header.status = -ETIMEDOUT;
+				req->complete(reply);
+			});
+	rguard.unlock();
+
+	worker::job j(std::move(msg), [ex, req] (message &reply) {
+				std::unique_lock<std::mutex> guard(req->lock);
+				req->done = true;
+				if (req->armed) {
+					req->armed = false;
+					ex->remove(req->timer);
+				}
 
-	for (auto &w: m_workers) {
-		w.reset(new worker());
+				if (req->completed)
+					return;
+				req->completed = true;
+				guard.unlock();
 
-		int err = w->start(callback);
-		if (err < 0) {
-			LOG(ERROR) << "could not start new worker thread, error: " << strerror(-err) << " [" << err << "]";
+				req->complete(reply);
+			}, deadline);
 
-			std::ostringstream ss;
-			ss << "could not start new worker thread, error: " << strerror(-err) << " [" << err << "]";
-			throw std::runtime_error(ss.str());
-		}
+	int err = dispatch(j, true);
+	if (err == -EAGAIN)
+		reject(j.msg);
+	if (err) {
+		message reply = message::copy_header(j.msg);
+		reply.header.status = err;
+		j.complete(reply);
 	}
 }
-controller::~controller()
-{
-	m_wait_need_exit = true;
-	m_wait_thread.join();
 
+void controller::check_deadlines()
+{
+	std::lock_guard<std::mutex> guard(m_lock);
 	for (auto &w: m_workers) {
-		int status;
-		w->stop(&status);
+		w->check_deadlines();
 	}
 }
 
-void controller::schedule(const message &msg, worker::completion_t complete)
+int controller::dispatch(worker::job &j, bool limited)
 {
+	uint64_t size = j.msg.header.size;
+
 	std::unique_lock<std::mutex> guard(m_lock);
-	if (m_workers.empty()) {
-		guard.unlock();
+	if (m_workers.empty())
+		return -ENOENT;
+
+	std::unique_lock<std::mutex> sguard(m_shared_queue.lock, std::defer_lock);
+	if (m_opt.dispatch == options::dispatch_shared_queue)
+		sguard.lock();
+
+	if (limited && (m_opt.queue_limit || m_opt.queue_bytes_limit)) {
+		size_t pending = m_shared_queue.queue.size();
+		uint64_t bytes = m_shared_queue.bytes;
+		for (auto &w: m_workers) {
+			pending += w->queue_size() + w->in_flight();
+			bytes += w->outstanding_bytes();
+		}
 
-		message reply = message::copy_header(msg);
-		reply.header.status = -ENOENT;
-		complete(reply);
-		return;
+		if (over_limit(pending, bytes, size, m_opt.queue_limit, m_opt.queue_bytes_limit))
+			return -EAGAIN;
+	}
+
+	// in shared queue mode message is pulled by the first worker which has free pipeline slot,
+	// least loaded worker is woken up to check the queue
+	if (m_opt.dispatch == options::dispatch_shared_queue) {
+		m_shared_queue.queue.push(std::move(j));
+		m_shared_queue.bytes += size;
+		sguard.unlock();
 	}
 
-	int pos = 0;
-	size_t size = m_workers[pos]->queue_size();
+	bool worker_limits = limited && m_opt.dispatch != options::dispatch_shared_queue &&
+		(m_opt.worker_queue_limit || m_opt.worker_queue_bytes_limit);
+
+	ssize_t pos = -1;
+	uint64_t min_load = ~0ULL;
 	for (size_t i = 0; i < m_workers.size(); ++i) {
 		auto &w = m_workers[i];
 
-		if (w->queue_size() < size) {
-			size = w->queue_size();
+		size_t pending = w->queue_size() + w->in_flight();
+		uint64_t bytes = w->outstanding_bytes();
+		if (worker_limits &&
+				over_limit(pending, bytes, size, m_opt.worker_queue_limit, m_opt.worker_queue_bytes_limit))
+			continue;
+
+		uint64_t load;
+		if (m_opt.dispatch == options::dispatch_least_bytes)
+			load = bytes;
+		else
+			load = pending;
+
+		if (load < min_load) {
+			min_load = load;
 			pos = i;
 		}
 	}
 
+	if (pos < 0)
+		return -EAGAIN;
+
 	auto &w = m_workers[pos];
-	w->queue(msg, complete);
+	if (m_opt.dispatch == options::dispatch_shared_queue)
+		w->notify();
+	else
+		w->queue(std::move(j));
+
+	return 0;
+}
+
+void controller::schedule(const std::vector<message> &msgs, worker::batch_completion_t complete)
+{
+	std::vector<message::header_t> headers;
+	headers.reserve(msgs.size());
+	for (auto &m: msgs) {
+		headers.push_back(m.header);
+	}
+
+	schedule(message::pack(msgs), [headers, complete] (const message &reply) {
+				std::vector<message> replies;
+
+				int err = reply.header.status;
+				if (!err)
+					err = message::unpack(reply, &replies);
+
+				if (err) {
+					replies.clear();
+					for (auto &hdr: headers) {
+						message r;
+						r.header = hdr;
+						r.header.size = 0;
+						r.header.status = err;
+						replies.emplace_back(std::move(r));
+					}
+				}
+
+				complete(replies);
+			});
 }
 
 void controller::wait_for_children()
 {
+	epoll_event ev[16];
+	std::vector<pid_t> pids;
+
 	while (!m_wait_need_exit) {
-		int status;
+		std::unique_lock<std::mutex> guard(m_watch_lock);
+		long timeout = m_polled ? 10 : -1;
+		guard.unlock();
 
-		pid_t pid = waitpid(-1, &status, WNOHANG);
-		if (pid > 0) {
-			LOG(ERROR) << "fpool::controller::wait_for_children: detected process termination"
-				": pid: " << pid <<
-				", exited: " << WIFEXITED(status) <<
-					" (status: " << WEXITSTATUS(status) << ")" <<
-				", killed-by-signal: " << WIFSIGNALED(status) <<
-					" (signal: " << WTERMSIG(status) << ", coredump: " << WCOREDUMP(status) << ")";
-
-			auto it = std::find_if(m_workers.begin(), m_workers.end(), [=] (const std::unique_ptr<worker> &w) {
-						return w->pid() == pid;
-					});
-			if (it == m_workers.end()) {
+		if (m_opt.max_workers > 0) {
+			resize();
+
+			long interval = std::max(m_opt.scale_interval, 1L);
+			timeout = timeout < 0 ? interval : std::min(timeout, interval);
+
+			long retire_timeout = remove_retired();
+			if (retire_timeout >= 0)
+				timeout = std::min(timeout, retire_timeout);
+		}
+
+		int nfds = epoll_wait(m_wait_epollfd, ev, sizeof(ev) / sizeof(ev[0]), timeout);
+		if (nfds < 0) {
+			int err = -errno;
+			if (err == -EINTR)
+				continue;
+
+			LOG(ERROR) << "fpool::controller::wait_for_children: could not wait for epoll event: " <<
+				strerror(-err) << " [" << err << "]";
+			break;
+		}
+
+		pids.clear();
+		for (int i = 0; i < nfds; ++i) {
+			if (ev[i].data.u64 == 0) {
+				uint64_t val;
+				ssize_t err = ::read(m_wait_wakefd, &val, sizeof(val));
+				(void) err;
+				continue;
+			}
+
+			// processes are only reaped by this thread, so timers can signal them without racing with pid reuse
+			if (ev[i].data.u64 == wait_timer_event) {
+				m_stop_timers->process();
 				continue;
 			}
 
-			if (WIFEXITED(status) || WIFSIGNALED(status)) {
-				int err;
+			pids.push_back(ev[i].data.u64);
+		}
 
-				(*it)->close();
-				err = (*it)->start(m_callback);
-				if (err < 0) {
-					LOG(ERROR) << "fpool::controller::wait_for_children: could not restart process: " <<
-						strerror(errno);
-					m_workers.erase(it);
-				}
+		guard.lock();
+		if (m_polled) {
+			for (auto &p: m_watched) {
+				if (!p.second)
+					pids.push_back(p.first);
+			}
+		}
+		guard.unlock();
+
+		// only owned processes are reaped
+		for (auto pid: pids) {
+			int status;
+			if (waitpid(pid, &status, WNOHANG) != pid)
+				continue;
+
+			unwatch(pid);
+			reap(pid, status);
+		}
+	}
+}
+
+void controller::reap(pid_t pid, int status)
+{
+	auto stopping = m_stopping.find(pid);
+	if (stopping != m_stopping.end()) {
+		m_stop_timers->remove(stopping->second);
+		m_stopping.erase(stopping);
+
+		LOG(INFO) << "fpool::controller::wait_for_children: process " << pid << " has been stopped";
+		return;
+	}
+
+	auto detected = std::chrono::steady_clock::now();
+
+	LOG(ERROR) << "fpool::controller::wait_for_children: detected process termination"
+		": pid: " << pid <<
+		", exited: " << WIFEXITED(status) <<
+			" (status: " << WEXITSTATUS(status) << ")" <<
+		", killed-by-signal: " << WIFSIGNALED(status) <<
+			" (signal: " << WTERMSIG(status) << ", coredump: " << WCOREDUMP(status) << ")";
+
+	auto it = std::find_if(m_workers.begin(), m_workers.end(), [=] (const std::unique_ptr<worker> &w) {
+				return w->pid() == pid;
+			});
+	if (it == m_workers.end()) {
+		if (drop_standby(pid))
+			fill_standby();
+		return;
+	}
+
+	// requests which have been sent to the dead process are failed right away,
+	// queued ones are sent to its replacement
+	(*it)->close();
+
+	int err = 0;
+	spawned sp;
+	bool standby = take_standby(&sp);
+	if (!standby)
+		err = spawn(&sp);
+	if (!err)
+		err = (*it)->start(std::move(sp));
+	if (err < 0) {
+		LOG(ERROR) << "fpool::controller::wait_for_children: could not restart process: " <<
+			strerror(-err) << " [" << err << "]";
+
+		std::deque<worker::job> queue;
+		(*it)->take_queue(&queue);
+
+		worker_metrics m;
+		(*it)->metrics(&m);
+		m.queued = m.in_flight = 0;
+
+		std::unique_lock<std::mutex> guard(m_lock);
+		add_metrics(&m_removed, m);
+		m_workers.erase(it);
+		guard.unlock();
+
+		// there is no replacement, queued requests are rerouted to the remaining workers
+		for (auto &j: queue) {
+			redispatch(j);
+		}
+	} else {
+		if (m_opt.redispatch_on_failure) {
+			std::deque<worker::job> queue;
+			(*it)->take_queue(&queue);
+
+			for (auto &j: queue) {
+				redispatch(j);
 			}
-		} else {
-			usleep(10000);
 		}
+
+		uint64_t usec = std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now() - detected).count();
+
+		std::unique_lock<std::mutex> guard(m_standby_lock);
+		m_respawn.respawns++;
+		if (standby)
+			m_respawn.standby_used++;
+		m_respawn.last_usec = usec;
+		m_respawn.max_usec = std::max(m_respawn.max_usec, usec);
+		m_respawn.total_usec += usec;
 	}
+
+	if (standby)
+		fill_standby();
 }
 
 std::vector<pid_t> controller::pids() const {
 	std::vector<pid_t> ret;
 
+	std::lock_guard<std::mutex> guard(m_lock);
 	for (auto &w: m_workers) {
 		ret.push_back(w->pid());
 	}
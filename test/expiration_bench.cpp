@@ -0,0 +1,169 @@
+#include "ribosome/expiration.hpp"
+#include "ribosome/sharded_expiration.hpp"
+#include "ribosome/timer.hpp"
+
+#include <boost/program_options.hpp>
+
+#include <atomic>
+#include <iostream>
+
+#include <stdio.h>
+
+#include <glog/logging.h>
+
+using namespace ioremap::ribosome;
+
+// Insert, remove and expiration throughput of expiration backends with large number of live timers.
+// Live timers are spread over @spread seconds in the future, churn inserts and removes one timer per step
+// keeping the number of live timers constant, it is split between @threads producers each owning
+// its own part of timers. Fire inserts timers expiring within one second and waits until all of them
+// have been called.
+
+struct bench_config {
+	std::string backend;
+	std::chrono::system_clock::duration resolution;
+	int timers;
+	int churn;
+	int spread;
+	int threads;
+	std::chrono::nanoseconds slack;
+};
+
+template <typename T>
+static void bench(T &ex, const bench_config &cfg)
+{
+	std::vector<typename T::token_t> tokens;
+	tokens.reserve(cfg.timers);
+
+	auto now = std::chrono::system_clock::now();
+	auto random_time = [&] (unsigned int *seed) {
+		return now + std::chrono::seconds(1 + rand_r(seed) % cfg.spread) +
+			std::chrono::microseconds(rand_r(seed) % 1000000);
+	};
+
+	unsigned int seed = 0;
+	timer tm;
+	for (int i = 0; i < cfg.timers; ++i) {
+		tokens.push_back(ex.insert(random_time(&seed), [] () {}, cfg.slack));
+	}
+	float insert_sec = tm.elapsed_seconds();
+
+	tm.restart();
+	std::vector<std::thread> producers;
+	for (int t = 0; t < cfg.threads; ++t) {
+		producers.emplace_back([&, t] () {
+					unsigned int seed = t + 1;
+					size_t part = tokens.size() / cfg.threads;
+					for (int i = 0; i < cfg.churn / cfg.threads; ++i) {
+						size_t pos = part * t + rand_r(&seed) % part;
+						ex.remove(tokens[pos]);
+						tokens[pos] = ex.insert(random_time(&seed), [] () {}, cfg.slack);
+					}
+				});
+	}
+	for (auto &p: producers) {
+		p.join();
+	}
+	float churn_sec = tm.elapsed_seconds();
+
+	tm.restart();
+	for (auto token: tokens) {
+		ex.remove(token);
+	}
+	float remove_sec = tm.elapsed_seconds();
+
+	std::atomic_int fired(0);
+	now = std::chrono::system_clock::now();
+	for (int i = 0; i < cfg.timers; ++i) {
+		ex.insert(now + std::chrono::microseconds(rand() % 1000000), [&] () {fired++;});
+	}
+
+	tm.restart();
+	while (fired != cfg.timers)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	float fire_sec = tm.elapsed_seconds();
+
+	printf("backend: %7s, resolution usecs: %6ld, timers: %8d, threads: %3d, "
+			"insert ops/sec: %10.1f, churn ops/sec: %10.1f, remove ops/sec: %10.1f, fire drain msecs: %7.1f\n",
+			cfg.backend.c_str(),
+			(long)std::chrono::duration_cast<std::chrono::microseconds>(cfg.resolution).count(),
+			cfg.timers, cfg.threads,
+			cfg.timers / insert_sec, cfg.churn * 2 / churn_sec, cfg.timers / remove_sec, fire_sec * 1000);
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	namespace bpo = boost::program_options;
+
+	bench_config cfg;
+	long resolution;
+	int shards;
+	long slack;
+	std::vector<int> threads;
+	std::vector<std::string> backends;
+
+	bpo::options_description generic("expiration benchmark options");
+	generic.add_options()
+		("help", "this help message")
+		("timers", bpo::value<int>(&cfg.timers)->default_value(1000000), "number of live timers")
+		("churn", bpo::value<int>(&cfg.churn)->default_value(1000000),
+			"number of remove and insert pairs with all timers live")
+		("spread", bpo::value<int>(&cfg.spread)->default_value(3600),
+			"live timers expire uniformly within this many seconds")
+		("resolution", bpo::value<long>(&resolution)->default_value(1000), "wheel tick resolution in microseconds")
+		("threads", bpo::value<std::vector<int>>(&threads)->composing(),
+			"number of churn producer threads, can be specified multiple times")
+		("slack", bpo::value<long>(&slack)->default_value(0), "timer slack in microseconds")
+		("shards", bpo::value<int>(&shards)->default_value(0), "number of shards of sharded backend, 0 - one per CPU")
+		("backend", bpo::value<std::vector<std::string>>(&backends)->composing(),
+			"backend to test (map, wheel, sharded), can be specified multiple times")
+		;
+
+	bpo::variables_map vm;
+	try {
+		bpo::store(bpo::command_line_parser(argc, argv).options(generic).run(), vm);
+
+		if (vm.count("help")) {
+			std::cout << generic << std::endl;
+			return 0;
+		}
+
+		bpo::notify(vm);
+	} catch (const std::exception &e) {
+		std::cerr << "Invalid options: " << e.what() << "\n" << generic << std::endl;
+		return -EINVAL;
+	}
+
+	if (backends.empty())
+		backends = {"map", "wheel", "sharded"};
+	if (threads.empty())
+		threads = {1, 4};
+
+	google::InitGoogleLogging(argv[0]);
+
+	cfg.resolution = std::chrono::microseconds(resolution);
+	cfg.slack = std::chrono::microseconds(slack);
+	for (auto &b: backends) {
+		for (auto t: threads) {
+			cfg.backend = b;
+			cfg.threads = t;
+
+			if (b == "map") {
+				expiration ex(expiration::backend_map);
+				bench(ex, cfg);
+			} else if (b == "wheel") {
+				expiration ex(expiration::backend_wheel, cfg.resolution);
+				bench(ex, cfg);
+			} else if (b == "sharded") {
+				sharded_expiration ex(shards, cfg.resolution);
+				bench(ex, cfg);
+			} else {
+				std::cerr << "Invalid backend: " << b << "\n" << generic << std::endl;
+				return -EINVAL;
+			}
+		}
+	}
+
+	return 0;
+}
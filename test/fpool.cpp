@@ -1,6 +1,14 @@
 #include "ribosome/fpool.hpp"
 
+#include <algorithm>
 #include <atomic>
+#include <fstream>
+#include <set>
+#include <sstream>
+
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <sched.h>
 
 #include <gtest/gtest.h>
 #include <glog/logging.h>
@@ -15,9 +23,9 @@ public:
 	void send_and_test(int cmd) {
 		fpool::message msg;
 		msg.header.cmd = cmd;
-		m_ctl.schedule(msg, [=](const fpool::message &reply) {
+		m_ctl.schedule(std::move(msg), [this, cmd] (const fpool::message &reply) {
 					ASSERT_EQ(reply.header.status, 0);
-					ASSERT_EQ(reply.header.cmd, msg.header.cmd + 1);
+					ASSERT_EQ(reply.header.cmd, cmd + 1);
 					ASSERT_EQ(reply.header.size, fpool_test::m_message.size());
 
 					std::string rdata(reply.data.get(), reply.header.size);
@@ -84,6 +92,1364 @@ TEST_F(fpool_test, restart)
 	m_cv.wait_for(l, std::chrono::seconds(3), [&] {return m_completed == 2;});
 }
 
+static void test_echo(const fpool::options &opt, int num, size_t max_size)
+{
+
+	std::mutex lock;
+	std::condition_variable cv;
+	std::atomic_int completed(0), failed(0);
+
+	fpool::controller ctl(opt, [] (const fpool::message &msg) {
+				fpool::message reply(msg.header.size);
+				reply.header.cmd = msg.header.cmd;
+				memcpy(reply.data.get(), msg.data.get(), msg.header.size);
+				return reply;
+			});
+
+	for (int i = 0; i < num; ++i) {
+		std::string data = std::to_string(i);
+		data.resize(rand() % max_size + data.size(), 'x');
+
+		fpool::message msg(data.size());
+		msg.header.cmd = i;
+		msg.header.id = i + 100;
+		memcpy(msg.data.get(), data.data(), data.size());
+
+		ctl.schedule(std::move(msg), [&, i, data] (const fpool::message &reply) {
+					if (reply.header.status != 0 ||
+							reply.header.cmd != i ||
+							reply.header.id != (uint64_t)i + 100 ||
+							std::string(reply.data.get(), reply.header.size) != data) {
+						failed++;
+					}
+
+					std::unique_lock<std::mutex> l(lock);
+					completed++;
+					cv.notify_one();
+				});
+	}
+
+	std::unique_lock<std::mutex> l(lock);
+	cv.wait_for(l, std::chrono::seconds(10), [&] {return completed == num;});
+
+	ASSERT_EQ(completed, num);
+	ASSERT_EQ(failed, 0);
+}
+
+// Worker callbacks run in forked processes, tests hold requests there by blocking on a pipe created
+// before the pool, every held request consumes one byte written by release().
+// Every request reaching wait() writes a byte into the second pipe, which is read by started().
+class process_gate {
+public:
+	process_gate() {
+		if (pipe(m_fd) < 0 || pipe(m_started) < 0)
+			throw std::runtime_error("could not create gate pipes");
+	}
+
+	~process_gate() {
+		::close(m_fd[0]);
+		::close(m_fd[1]);
+		::close(m_started[0]);
+		::close(m_started[1]);
+	}
+
+	void wait() const {
+		char c = 'x';
+		ssize_t err = ::write(m_started[1], &c, 1);
+		(void) err;
+
+		while (::read(m_fd[0], &c, 1) < 0 && errno == EINTR)
+			;
+	}
+
+	void release(int num) const {
+		std::string data(num, 'x');
+		ssize_t err = ::write(m_fd[1], data.data(), data.size());
+		(void) err;
+	}
+
+	// blocks until @num more requests have reached wait()
+	void started(int num) const {
+		char c;
+		for (int i = 0; i < num; ++i) {
+			while (::read(m_started[0], &c, 1) < 0 && errno == EINTR)
+				;
+		}
+	}
+
+private:
+	int m_fd[2];
+	int m_started[2];
+};
+
+// Waits for a state which pool threads change without notifying anybody,
+// the limit only stops the test from hanging when the state is never reached.
+template <typename Pred>
+static bool wait_until(Pred pred)
+{
+	auto limit = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (!pred()) {
+		if (std::chrono::steady_clock::now() > limit)
+			return false;
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	return true;
+}
+
+// reply carries pid of the process which has processed the request
+static fpool::message pid_reply(const fpool::message &)
+{
+	fpool::message reply;
+	reply.header.cmd = getpid();
+	return reply;
+}
+
+// payload received through the shared memory ring points into a shared mapping, inline one does not
+static bool shared_mapping(const void *ptr)
+{
+	std::ifstream maps("/proc/self/maps");
+	std::string line;
+	while (std::getline(maps, line)) {
+		unsigned long start, end;
+		char perms[5];
+		if (sscanf(line.c_str(), "%lx-%lx %4s", &start, &end, perms) != 3)
+			continue;
+
+		if ((unsigned long)ptr >= start && (unsigned long)ptr < end)
+			return perms[3] == 's';
+	}
+
+	return false;
+}
+
+TEST(fpool, pipeline)
+{
+	fpool::options opt;
+	opt.workers = 2;
+	opt.max_in_flight = 16;
+
+	test_echo(opt, 1000, 16);
+
+	// the first request blocks the process, the next ones are sent to it up to the pipeline depth anyway
+	process_gate gate;
+	opt.workers = 1;
+	opt.max_in_flight = 4;
+	fpool::controller ctl(opt, [&] (const fpool::message &msg) {
+				gate.wait();
+				return pid_reply(msg);
+			});
+
+	std::vector<std::future<fpool::message>> futures;
+	for (int i = 0; i < 8; ++i) {
+		futures.emplace_back(ctl.schedule(fpool::message(16)));
+	}
+
+	for (int i = 0; i < 1000 && ctl.metrics().workers[0].in_flight != 4; ++i)
+		usleep(1000);
+	auto m = ctl.metrics().workers[0];
+	ASSERT_EQ(m.in_flight, 4);
+	ASSERT_EQ(m.queued, 4);
+
+	gate.release(8);
+	for (auto &f: futures) {
+		ASSERT_EQ(f.get().header.status, 0);
+	}
+}
+
+TEST(fpool, shm)
+{
+	fpool::options opt;
+	opt.workers = 2;
+	opt.max_in_flight = 4;
+	opt.shm_ring_size = 1024 * 1024;
+
+	// some messages do not fit into the ring and are sent inline
+	test_echo(opt, 200, 600 * 1024);
+
+	// payloads which fit are passed through the rings in both directions
+	opt.workers = 1;
+	fpool::controller ctl(opt, [] (const fpool::message &msg) {
+				fpool::message reply(msg.header.size);
+				reply.header.cmd = shared_mapping(msg.data.get());
+				return reply;
+			});
+
+	fpool::message small = ctl.schedule(fpool::message(4096)).get();
+	ASSERT_EQ(small.header.status, 0);
+	ASSERT_EQ(small.header.cmd, 1);
+	ASSERT_TRUE(shared_mapping(small.data.get()));
+
+	fpool::message large = ctl.schedule(fpool::message(2 * opt.shm_ring_size)).get();
+	ASSERT_EQ(large.header.status, 0);
+	ASSERT_EQ(large.header.cmd, 0);
+	ASSERT_FALSE(shared_mapping(large.data.get()));
+}
+
+TEST(fpool, shared_io_loop)
+{
+	fpool::options opt;
+	opt.workers = 4;
+	opt.io_threads = 1;
+	opt.max_in_flight = 4;
+
+	test_echo(opt, 1000, 4096);
+
+	// held requests are spread over the workers, all of them are completed by the only loop thread
+	process_gate gate;
+	fpool::controller ctl(opt, [&] (const fpool::message &msg) {
+				gate.wait();
+				return pid_reply(msg);
+			});
+
+	std::mutex lock;
+	std::condition_variable cv;
+	std::set<pid_t> pids;
+	std::set<std::thread::id> threads;
+	int completed = 0;
+
+	for (int i = 0; i < 4; ++i) {
+		ctl.schedule(fpool::message(16), [&] (const fpool::message &reply) {
+					std::unique_lock<std::mutex> guard(lock);
+					pids.insert(reply.header.cmd);
+					threads.insert(std::this_thread::get_id());
+					completed++;
+					cv.notify_one();
+				});
+	}
+	gate.release(4);
+
+	std::unique_lock<std::mutex> guard(lock);
+	cv.wait_for(guard, std::chrono::seconds(10), [&] {return completed == 4;});
+	ASSERT_EQ(completed, 4);
+	ASSERT_GT(pids.size(), 1);
+	ASSERT_EQ(threads.size(), 1);
+	ASSERT_NE(*threads.begin(), std::this_thread::get_id());
+}
+
+TEST(fpool, dispatch)
+{
+	fpool::options opt;
+	opt.workers = 3;
+	opt.max_in_flight = 2;
+
+	opt.dispatch = fpool::options::dispatch_least_bytes;
+	test_echo(opt, 500, 4096);
+
+	opt.dispatch = fpool::options::dispatch_shared_queue;
+	test_echo(opt, 500, 4096);
+
+	opt.workers = 2;
+	opt.max_in_flight = 4;
+
+	// small requests are not queued to the worker which holds a large one
+	{
+		process_gate gate;
+		opt.dispatch = fpool::options::dispatch_least_bytes;
+		fpool::controller ctl(opt, [&] (const fpool::message &msg) {
+					gate.wait();
+					return pid_reply(msg);
+				});
+
+		auto large = ctl.schedule(fpool::message(64 * 1024));
+		std::vector<std::future<fpool::message>> small;
+		for (int i = 0; i < 3; ++i) {
+			small.emplace_back(ctl.schedule(fpool::message(16)));
+		}
+		gate.release(4);
+
+		pid_t large_pid = large.get().header.cmd;
+		pid_t small_pid = small[0].get().header.cmd;
+		ASSERT_NE(large_pid, small_pid);
+		for (size_t i = 1; i < small.size(); ++i) {
+			ASSERT_EQ(small[i].get().header.cmd, small_pid);
+		}
+	}
+
+	// requests are not stuck behind the worker which hangs, they are pulled by the other one
+	{
+		process_gate gate;
+		opt.dispatch = fpool::options::dispatch_shared_queue;
+		opt.max_in_flight = 1;
+		fpool::controller ctl(opt, [&] (const fpool::message &msg) {
+					if (msg.header.cmd == 1)
+						gate.wait();
+					return pid_reply(msg);
+				});
+
+		fpool::message msg;
+		msg.header.cmd = 1;
+		auto hung = ctl.schedule(std::move(msg));
+
+		// the hanging request has been pulled, so the next ones wake up the idle worker
+		auto in_flight = [&] () {
+			size_t num = 0;
+			for (auto &w: ctl.metrics().workers)
+				num += w.in_flight;
+			return num;
+		};
+		for (int i = 0; i < 1000 && in_flight() != 1; ++i)
+			usleep(1000);
+		ASSERT_EQ(in_flight(), 1);
+
+		for (int i = 0; i < 10; ++i) {
+			ASSERT_EQ(ctl.schedule(fpool::message(16)).get().header.status, 0);
+		}
+
+		gate.release(1);
+		ASSERT_EQ(hung.get().header.status, 0);
+	}
+}
+
+TEST(fpool, buffer_pool)
+{
+	char *ptr;
+	{
+		fpool::message msg(100);
+		ptr = msg.data.get();
+
+		fpool::message moved(std::move(msg));
+		ASSERT_FALSE(msg.data);
+		ASSERT_EQ(moved.data.get(), ptr);
+	}
+
+	// the same size class, buffer is taken from the thread cache
+	fpool::message msg(128);
+	ASSERT_EQ(msg.data.get(), ptr);
+
+	fpool::message large(fpool::buffer::max_pooled_size + 1);
+	ASSERT_TRUE(large.data);
+}
+
+TEST(fpool, buffer_pool_return)
+{
+	fpool::controller ctl(1, [] (const fpool::message &msg) {
+				return fpool::message(msg.header.size);
+			});
+
+	// request buffer is released by the IO loop thread and goes back to the cache of the producer thread,
+	// fresh thread is used, so that its cache is empty
+	std::thread producer([&] () {
+				fpool::message msg(1000);
+				char *ptr = msg.data.get();
+
+				std::promise<void> done;
+				ctl.schedule(std::move(msg), [&] (const fpool::message &) {
+							done.set_value();
+						});
+				done.get_future().wait();
+
+				// missed buffers are held, so that the next allocation checks the return list again
+				std::vector<fpool::message> held;
+				for (int i = 0; i < 100; ++i) {
+					fpool::message again(1000);
+					if (again.data.get() == ptr)
+						return;
+
+					held.emplace_back(std::move(again));
+					usleep(1000);
+				}
+
+				ADD_FAILURE() << "request buffer has not been returned to the producer thread";
+			});
+	producer.join();
+}
+
+static fpool::message batch_echo(const fpool::message &msg)
+{
+	fpool::message reply(msg.header.size);
+	reply.header.cmd = msg.header.cmd;
+	memcpy(reply.data.get(), msg.data.get(), msg.header.size);
+	return reply;
+}
+
+static void test_batch(fpool::controller &ctl, int batches, int batch_size, int cmd_diff)
+{
+	std::mutex lock;
+	std::condition_variable cv;
+	std::atomic_int completed(0), failed(0);
+
+	for (int b = 0; b < batches; ++b) {
+		std::vector<fpool::message> msgs;
+		for (int i = 0; i < batch_size; ++i) {
+			std::string data = std::to_string(b) + "." + std::to_string(i);
+
+			fpool::message msg(data.size());
+			msg.header.cmd = i;
+			msg.header.id = b * batch_size + i;
+			memcpy(msg.data.get(), data.data(), data.size());
+			msgs.emplace_back(std::move(msg));
+		}
+
+		ctl.schedule(msgs, [&, b, batch_size, cmd_diff] (const std::vector<fpool::message> &replies) {
+					if ((int)replies.size() != batch_size) {
+						failed++;
+					} else {
+						for (int i = 0; i < batch_size; ++i) {
+							auto &reply = replies[i];
+							std::string data = std::to_string(b) + "." + std::to_string(i);
+
+							if (reply.header.status != 0 ||
+									reply.header.cmd != i + cmd_diff ||
+									reply.header.id != (uint64_t)(b * batch_size + i) ||
+									std::string(reply.data.get(), reply.header.size) != data) {
+								failed++;
+							}
+						}
+					}
+
+					std::unique_lock<std::mutex> l(lock);
+					completed++;
+					cv.notify_one();
+				});
+	}
+
+	std::unique_lock<std::mutex> l(lock);
+	cv.wait_for(l, std::chrono::seconds(10), [&] {return completed == batches;});
+
+	ASSERT_EQ(completed, batches);
+	ASSERT_EQ(failed, 0);
+}
+
+TEST(fpool, batch)
+{
+	fpool::options opt;
+	opt.workers = 2;
+	opt.max_in_flight = 2;
+
+	fpool::controller ctl(opt, batch_echo);
+	test_batch(ctl, 20, 100, 0);
+
+	fpool::controller bctl(opt, batch_echo, [] (const std::vector<fpool::message> &msgs) {
+				std::vector<fpool::message> replies;
+				for (auto &msg: msgs) {
+					replies.emplace_back(batch_echo(msg));
+					replies.back().header.cmd++;
+				}
+				return replies;
+			});
+	test_batch(bctl, 20, 100, 1);
+}
+
+TEST(fpool, fd_passing)
+{
+	// child replies with memory file containing request payload in upper case
+	fpool::controller ctl(1, [] (const fpool::message &msg) {
+				if (!msg.fd)
+					return fpool::message();
+
+				fpool::message reply = fpool::message::memfd(msg.header.size);
+				reply.header.cmd = msg.header.cmd;
+				for (uint64_t i = 0; i < msg.header.size; ++i)
+					reply.data.get()[i] = toupper(msg.data.get()[i]);
+				return reply;
+			});
+
+	std::string data(3 * 1024 * 1024 + 17, 'x');
+	data[0] = 'a';
+	data[data.size() - 1] = 'z';
+
+	std::string expected(data);
+	for (auto &c: expected)
+		c = toupper(c);
+
+	std::mutex lock;
+	std::condition_variable cv;
+	std::atomic_int completed(0), failed(0);
+
+	auto check = [&] (const std::string &expected) {
+		return [&, expected] (const fpool::message &reply) {
+			if (reply.header.status != 0 || !reply.fd ||
+					std::string(reply.data.get(), reply.header.size) != expected)
+				failed++;
+
+			std::unique_lock<std::mutex> guard(lock);
+			completed++;
+			cv.notify_one();
+		};
+	};
+
+	fpool::message msg = fpool::message::memfd(data.size());
+	memcpy(msg.data.get(), data.data(), data.size());
+	ctl.schedule(std::move(msg), check(expected));
+
+	// region of the regular file at unaligned offset, it is never mapped by the sender
+	FILE *tmp = tmpfile();
+	ASSERT_NE(tmp, nullptr);
+	ASSERT_EQ(fwrite(data.data(), 1, data.size(), tmp), data.size());
+	fflush(tmp);
+
+	size_t offset = 4096 + 100;
+	ctl.schedule(fpool::message::from_fd(dup(fileno(tmp)), offset, data.size() - offset),
+			check(expected.substr(offset)));
+	fclose(tmp);
+
+	std::unique_lock<std::mutex> guard(lock);
+	cv.wait(guard, [&] {return completed == 2;});
+	ASSERT_EQ(failed, 0);
+
+	// mapped payload is packed, region which is not mapped is packed as an empty payload
+	std::vector<fpool::message> msgs;
+	msgs.emplace_back(fpool::message::memfd(4));
+	memcpy(msgs.back().data.get(), "data", 4);
+	msgs.emplace_back(fpool::message::from_fd(open("/dev/null", O_RDONLY), 0, 100));
+
+	std::vector<fpool::message> unpacked;
+	ASSERT_EQ(fpool::message::unpack(fpool::message::pack(msgs), &unpacked), 0);
+	ASSERT_EQ(unpacked.size(), 2);
+	ASSERT_EQ(std::string(unpacked[0].data.get(), unpacked[0].header.size), "data");
+	ASSERT_EQ(unpacked[1].header.size, 0);
+}
+
+static int prefork_generation = 0;
+
+TEST(fpool, prefork)
+{
+	fpool::options opt;
+	opt.workers = 2;
+	opt.max_in_flight = 4;
+	opt.shm_ring_size = 1024 * 1024;
+	opt.prefork = true;
+	opt.standby = 1;
+
+	test_echo(opt, 200, 4096);
+
+	fpool::controller ctl(opt, [] (const fpool::message &msg) {
+				fpool::message reply(msg.header.size);
+				reply.header.cmd = msg.header.cmd + 1;
+				memcpy(reply.data.get(), msg.data.get(), msg.header.size);
+				return reply;
+			});
+
+	// workers are forked by zygote, but they are children of this process
+	auto pids = ctl.pids();
+	ASSERT_EQ(pids.size(), 2);
+	for (auto pid: pids) {
+		std::ifstream in("/proc/" + std::to_string(pid) + "/stat");
+		std::string stat((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		std::istringstream ss(stat.substr(stat.rfind(')') + 2));
+		std::string state;
+		pid_t ppid;
+		ss >> state >> ppid;
+		ASSERT_EQ(ppid, getpid());
+	}
+
+	kill(pids[0], SIGKILL);
+	for (int i = 0; i < 300 && ctl.respawns().respawns == 0; ++i)
+		usleep(10000);
+
+	auto stats = ctl.respawns();
+	ASSERT_EQ(stats.respawns, 1);
+	ASSERT_EQ(stats.standby_used, 1);
+	ASSERT_NE(ctl.pids()[0], pids[0]);
+
+	std::mutex lock;
+	std::condition_variable cv;
+	std::atomic_int completed(0);
+
+	std::string data("prefork");
+	for (int i = 0; i < 10; ++i) {
+		fpool::message msg(data.size());
+		msg.header.cmd = i;
+		memcpy(msg.data.get(), data.data(), data.size());
+
+		ctl.schedule(std::move(msg), [&, i] (const fpool::message &reply) {
+					if (reply.header.status == 0 && reply.header.cmd == i + 1 &&
+							std::string(reply.data.get(), reply.header.size) == data) {
+						std::unique_lock<std::mutex> guard(lock);
+						completed++;
+						cv.notify_one();
+					}
+				});
+	}
+
+	std::unique_lock<std::mutex> guard(lock);
+	cv.wait_for(guard, std::chrono::seconds(10), [&] {return completed == 10;});
+	ASSERT_EQ(completed, 10);
+	guard.unlock();
+
+	// replacement is forked from the zygote, so it does not see changes made after the pool has started,
+	// without prefork it is forked from this process and sees them
+	opt.workers = 1;
+	opt.standby = 0;
+	for (auto prefork: {true, false}) {
+		opt.prefork = prefork;
+
+		prefork_generation = 1;
+		fpool::controller gctl(opt, [] (const fpool::message &) {
+					fpool::message reply;
+					reply.header.cmd = prefork_generation;
+					return reply;
+				});
+		prefork_generation = 2;
+
+		kill(gctl.pids()[0], SIGKILL);
+		for (int i = 0; i < 1000 && gctl.respawns().respawns == 0; ++i)
+			usleep(1000);
+		ASSERT_EQ(gctl.respawns().respawns, 1);
+
+		ASSERT_EQ(gctl.schedule(fpool::message()).get().header.cmd, prefork ? 1 : 2);
+	}
+}
+
+TEST(fpool, reap_owned_only)
+{
+	fpool::options opt;
+	opt.workers = 2;
+
+	fpool::controller ctl(opt, batch_echo);
+
+	// child which does not belong to the pool must not be reaped by it
+	pid_t child = fork();
+	if (child == 0)
+		_exit(7);
+
+	pid_t worker_pid = ctl.pids()[0];
+	kill(worker_pid, SIGKILL);
+	for (int i = 0; i < 300 && ctl.respawns().respawns == 0; ++i)
+		usleep(10000);
+
+	ASSERT_EQ(ctl.respawns().respawns, 1);
+	ASSERT_NE(ctl.pids()[0], worker_pid);
+
+	int status;
+	ASSERT_EQ(waitpid(child, &status, 0), child);
+	ASSERT_TRUE(WIFEXITED(status));
+	ASSERT_EQ(WEXITSTATUS(status), 7);
+
+	test_batch(ctl, 5, 10, 0);
+}
+
+TEST(fpool, deadline)
+{
+	fpool::options opt;
+	opt.workers = 1;
+	opt.kill_timeout = 200;
+
+	// the first request hangs, worker has to be killed to process anything else
+	process_gate gate;
+	fpool::controller ctl(opt, [&] (const fpool::message &msg) {
+				if (msg.header.cmd == 0)
+					gate.wait();
+
+				return batch_echo(msg);
+			});
+
+	std::mutex lock;
+	std::condition_variable cv;
+	std::vector<int> statuses(5, 1);
+	int completed = 0;
+
+	auto now = std::chrono::system_clock::now();
+	for (int i = 0; i < 5; ++i) {
+		fpool::message msg;
+		msg.header.cmd = i;
+
+		auto complete = [&, i] (const fpool::message &reply) {
+			std::unique_lock<std::mutex> guard(lock);
+			statuses[i] = reply.header.status;
+			completed++;
+			cv.notify_one();
+		};
+
+		// the last request does not have a deadline and is processed by the restarted worker
+		if (i == 4)
+			ctl.schedule(std::move(msg), complete);
+		else
+			ctl.schedule(std::move(msg), now + std::chrono::milliseconds(50 + i * 10), complete);
+	}
+
+	// the hung request is never released
+	gate.started(1);
+
+	std::unique_lock<std::mutex> guard(lock);
+	ASSERT_TRUE(cv.wait_for(guard, std::chrono::seconds(10), [&] {return completed == 5;}));
+
+	for (int i = 0; i < 4; ++i)
+		ASSERT_EQ(statuses[i], -ETIMEDOUT);
+	ASSERT_EQ(statuses[4], 0);
+
+	// replacement can complete the last request before its respawn is counted
+	ASSERT_TRUE(wait_until([&] {return ctl.respawns().respawns == 1;}));
+
+	// expired requests are counted when they are dropped from the queue by the replacement
+	ASSERT_EQ(ctl.metrics().total.timeouts, 4);
+}
+
+TEST(fpool, destroy_queued)
+{
+	for (auto dispatch: {fpool::options::dispatch_least_outstanding, fpool::options::dispatch_shared_queue}) {
+		fpool::options opt;
+		opt.workers = 1;
+		opt.dispatch = dispatch;
+
+		std::vector<std::future<fpool::message>> futures;
+		{
+			// the first request hangs, the rest stay queued until the pool is destroyed
+			fpool::controller ctl(opt, [] (const fpool::message &msg) {
+						sleep(100);
+						return batch_echo(msg);
+					});
+
+			for (int i = 0; i < 5; ++i) {
+				futures.emplace_back(ctl.schedule(fpool::message(16)));
+			}
+		}
+
+		for (auto &f: futures) {
+			ASSERT_EQ(f.get().header.status, -ECONNRESET);
+		}
+	}
+}
+
+TEST(fpool, admission)
+{
+	fpool::options opt;
+	opt.workers = 1;
+	opt.worker_queue_limit = 2;
+	opt.queue_bytes_limit = 1024;
+
+	process_gate gate;
+	fpool::controller ctl(opt, [&] (const fpool::message &msg) {
+				gate.wait();
+				return batch_echo(msg);
+			});
+
+	std::mutex lock;
+	std::condition_variable cv;
+	int completed = 0;
+	auto complete = [&] (const fpool::message &reply) {
+		std::lock_guard<std::mutex> guard(lock);
+		if (reply.header.status == 0)
+			completed++;
+		cv.notify_one();
+	};
+
+	for (int i = 0; i < 2; ++i) {
+		fpool::message msg(100);
+		ASSERT_EQ(ctl.try_schedule(std::move(msg), complete), 0);
+	}
+
+	// rejected message is left intact
+	fpool::message msg(100);
+	char *ptr = msg.data.get();
+	ASSERT_EQ(ctl.try_schedule(std::move(msg), complete), -EAGAIN);
+	ASSERT_EQ(msg.data.get(), ptr);
+
+	// nothing is released, so there is no free slot
+	ASSERT_EQ(ctl.schedule_wait(std::move(msg), complete, 10), -ETIMEDOUT);
+	ASSERT_EQ(msg.data.get(), ptr);
+
+	// completion of the first request frees a slot for the waiting one
+	auto waited = std::async(std::launch::async, [&] () {
+				return ctl.schedule_wait(std::move(msg), complete, 10000);
+			});
+	ASSERT_TRUE(wait_until([&] {return ctl.admission().waited == 2;}));
+	gate.release(1);
+	ASSERT_EQ(waited.get(), 0);
+
+	auto st = ctl.admission();
+	ASSERT_EQ(st.rejected, 2);
+	ASSERT_EQ(st.rejected_bytes, 200);
+	ASSERT_EQ(st.waited, 2);
+	ASSERT_EQ(st.timed_out, 1);
+
+	// global bytes limit, plain schedule() completes rejected request with -EAGAIN
+	std::atomic_int status(0);
+	ctl.schedule(fpool::message(2048), [&] (const fpool::message &reply) {
+				status = reply.header.status;
+			});
+	ASSERT_EQ(status, -EAGAIN);
+
+	gate.release(2);
+	std::unique_lock<std::mutex> guard(lock);
+	cv.wait_for(guard, std::chrono::seconds(10), [&] {return completed == 3;});
+	ASSERT_EQ(completed, 3);
+}
+
+TEST(fpool, priority)
+{
+	fpool::options opt;
+	opt.workers = 1;
+	opt.max_in_flight = 1;
+
+	process_gate gate;
+	fpool::controller ctl(opt, [&] (const fpool::message &msg) {
+				gate.wait();
+				return batch_echo(msg);
+			});
+
+	std::mutex lock;
+	std::condition_variable cv;
+	std::vector<int> order;
+	auto schedule = [&] (int prio) {
+		fpool::message msg(16);
+		msg.set_priority(prio);
+		ASSERT_EQ(msg.priority(), prio);
+
+		ctl.schedule(std::move(msg), [&, prio] (const fpool::message &) {
+					std::lock_guard<std::mutex> guard(lock);
+					order.push_back(prio);
+					cv.notify_one();
+				});
+	};
+
+	// the first request occupies the worker while the rest are queued
+	schedule(0);
+	gate.started(1);
+
+	for (int i = 0; i < 3; ++i)
+		schedule(0);
+	for (int i = 0; i < 3; ++i)
+		schedule(fpool::message::priorities - 1);
+
+	auto st = ctl.priorities();
+	ASSERT_EQ(st.size(), fpool::message::priorities);
+	ASSERT_EQ(st[0].queued, 3);
+	ASSERT_EQ(st[fpool::message::priorities - 1].queued, 3);
+
+	gate.release(7);
+
+	std::vector<int> expected = {0, 3, 3, 3, 0, 0, 0};
+	std::unique_lock<std::mutex> guard(lock);
+	cv.wait_for(guard, std::chrono::seconds(10), [&] {return order.size() == expected.size();});
+	ASSERT_EQ(order, expected);
+
+	st = ctl.priorities();
+	ASSERT_EQ(st[0].completed, 4);
+	ASSERT_EQ(st[3].completed, 3);
+	ASSERT_EQ(st[3].queued, 0);
+	ASSERT_GE(st[0].max_usec, st[3].max_usec);
+}
+
+TEST(fpool, priority_weighted)
+{
+	fpool::options opt;
+	opt.workers = 1;
+	opt.max_in_flight = 1;
+	opt.priority = fpool::options::priority_weighted;
+
+	// the first request occupies the worker while the rest are queued
+	process_gate gate;
+	fpool::controller ctl(opt, [&] (const fpool::message &msg) {
+				if (msg.header.cmd == 1)
+					gate.wait();
+				return batch_echo(msg);
+			});
+
+	std::mutex lock;
+	std::condition_variable cv;
+	std::vector<int> order;
+	auto schedule = [&] (int prio, int cmd) {
+		fpool::message msg(16);
+		msg.header.cmd = cmd;
+		msg.set_priority(prio);
+
+		ctl.schedule(std::move(msg), [&, prio] (const fpool::message &) {
+					std::lock_guard<std::mutex> guard(lock);
+					order.push_back(prio);
+					cv.notify_one();
+				});
+	};
+
+	schedule(0, 1);
+	gate.started(1);
+
+	// class 2 stays empty and is skipped
+	int per_class = 40;
+	for (int i = 0; i < per_class; ++i) {
+		schedule(0, 0);
+		schedule(1, 0);
+		schedule(3, 0);
+	}
+	gate.release(1);
+
+	size_t num = per_class * 3 + 1;
+	std::unique_lock<std::mutex> guard(lock);
+	cv.wait_for(guard, std::chrono::seconds(10), [&] {return order.size() == num;});
+	ASSERT_EQ(order.size(), num);
+
+	// while all classes are non-empty, every round sends 8 requests of class 3, 2 of class 1 and 1 of class 0
+	int round = opt.priority_weights[3] + opt.priority_weights[1] + opt.priority_weights[0];
+	int rounds = 3;
+	std::vector<int> counts(fpool::message::priorities, 0);
+	for (int i = 1; i <= round * rounds; ++i) {
+		counts[order[i]]++;
+	}
+
+	ASSERT_EQ(counts[3], opt.priority_weights[3] * rounds);
+	ASSERT_EQ(counts[1], opt.priority_weights[1] * rounds);
+	ASSERT_EQ(counts[0], opt.priority_weights[0] * rounds);
+	ASSERT_EQ(counts[2], 0);
+
+	// the lowest class is not starved by the higher ones
+	auto first_low = std::find(order.begin() + 1, order.end(), 0);
+	ASSERT_LE(first_low - order.begin(), round);
+}
+
+TEST(fpool, elastic)
+{
+	fpool::options opt;
+	opt.workers = 1;
+	opt.min_workers = 1;
+	opt.max_workers = 3;
+	opt.scale_up_wait = 0;
+	opt.scale_down_idle = 0;
+	opt.scale_interval = 10;
+	opt.dispatch = fpool::options::dispatch_shared_queue;
+
+	process_gate gate;
+	fpool::controller ctl(opt, [&] (const fpool::message &msg) {
+				gate.wait();
+				return batch_echo(msg);
+			});
+	ASSERT_EQ(ctl.pids().size(), 1);
+
+	std::vector<std::future<fpool::message>> futures;
+	for (int i = 0; i < 6; ++i) {
+		futures.emplace_back(ctl.schedule(fpool::message(16)));
+	}
+
+	// requests wait in queue while workers hold the previous ones, so the pool grows up to its upper bound,
+	// every new worker pulls one more request, it can do that before it is added to the pool
+	gate.started(3);
+	ASSERT_TRUE(wait_until([&] {return ctl.pids().size() == 3;}));
+
+	gate.release(6);
+	for (auto &f: futures) {
+		ASSERT_EQ(f.get().header.status, 0);
+	}
+
+	// idle workers are stopped down to the lower bound
+	ASSERT_TRUE(wait_until([&] {return ctl.pids().size() == 1;}));
+
+	gate.release(1);
+	ASSERT_EQ(ctl.schedule(fpool::message(16)).get().header.status, 0);
+}
+
+TEST(fpool, schedule_removed_worker)
+{
+	// workers are retired as soon as they are idle and started again when anything waits in queue,
+	// every burst is scheduled while workers are being retired and freed
+	fpool::options opt;
+	opt.workers = 1;
+	opt.min_workers = 1;
+	opt.max_workers = 3;
+	opt.scale_up_wait = 0;
+	opt.scale_down_idle = 0;
+	opt.scale_interval = 1;
+	opt.dispatch = fpool::options::dispatch_shared_queue;
+
+	fpool::controller elastic(opt, batch_echo);
+	for (int burst = 0; burst < 50; ++burst) {
+		std::vector<std::future<fpool::message>> futures;
+		for (int i = 0; i < 20; ++i) {
+			futures.emplace_back(elastic.schedule(fpool::message(16)));
+		}
+
+		for (auto &f: futures) {
+			ASSERT_EQ(f.get().header.status, 0);
+		}
+	}
+
+	// requests are scheduled right before the process crashes, its worker is closed by the wait thread
+	// and started again, requests are either completed or failed, but never lost,
+	// IO loop fails them with write error if it notices the crash first
+	fpool::controller ctl(1, batch_echo);
+	for (int round = 0; round < 10; ++round) {
+		uint64_t respawns = ctl.respawns().respawns;
+		pid_t pid = ctl.pids()[0];
+
+		std::vector<std::future<fpool::message>> futures;
+		for (int i = 0; i < 20; ++i) {
+			futures.emplace_back(ctl.schedule(fpool::message(16)));
+		}
+		kill(pid, SIGKILL);
+
+		for (auto &f: futures) {
+			int status = f.get().header.status;
+			ASSERT_TRUE(status == 0 || status == -ECONNRESET || status == -EPIPE) << status;
+		}
+
+		// the next round must not kill the replacement before it is known
+		ASSERT_TRUE(wait_until([&] {return ctl.respawns().respawns == respawns + 1;}));
+	}
+}
+
+TEST(fpool, affinity)
+{
+	cpu_set_t allowed;
+	ASSERT_EQ(sched_getaffinity(0, sizeof(allowed), &allowed), 0);
+
+	int cpu = 0;
+	while (!CPU_ISSET(cpu, &allowed))
+		cpu++;
+
+	fpool::options opt;
+	opt.workers = 2;
+	opt.io_threads = 1;
+	opt.shm_ring_size = 64 * 1024;
+	opt.affinity = fpool::options::affinity_cpu;
+	opt.affinity_cpus = {cpu};
+
+	test_echo(opt, 100, 4096);
+
+	fpool::controller ctl(opt, [] (const fpool::message &) {
+				fpool::message reply;
+				reply.header.cmd = sched_getcpu();
+				return reply;
+			});
+
+	// workers of the loop are not stacked on its CPU, they can run on any allowed CPU of its node
+	cpu_set_t node_set;
+	ASSERT_EQ(sched_getaffinity(ctl.pids()[0], sizeof(node_set), &node_set), 0);
+	ASSERT_TRUE(CPU_ISSET(cpu, &node_set));
+
+	for (auto pid: ctl.pids()) {
+		cpu_set_t set;
+		ASSERT_EQ(sched_getaffinity(pid, sizeof(set), &set), 0);
+		ASSERT_TRUE(CPU_EQUAL(&set, &node_set));
+
+		for (int c = 0; c < CPU_SETSIZE; ++c) {
+			ASSERT_TRUE(!CPU_ISSET(c, &set) || CPU_ISSET(c, &allowed));
+		}
+	}
+
+	// completions are called from the loop thread, which runs on its CPU
+	std::promise<int> loop_cpu;
+	int worker_cpu = -1;
+	ctl.schedule(fpool::message(), [&] (const fpool::message &reply) {
+				worker_cpu = reply.header.cmd;
+				loop_cpu.set_value(sched_getcpu());
+			});
+	ASSERT_EQ(loop_cpu.get_future().get(), cpu);
+	ASSERT_TRUE(CPU_ISSET(worker_cpu, &node_set));
+}
+
+TEST(fpool, histogram)
+{
+	for (uint64_t v: {0UL, 1UL, 31UL, 32UL, 33UL, 1000UL, 123456789UL, ~0UL}) {
+		int b = fpool::histogram::bucket(v);
+		ASSERT_LT(b, fpool::histogram::buckets);
+		ASSERT_GE(fpool::histogram::bucket_max(b), v);
+		ASSERT_LE(fpool::histogram::bucket_max(b) - v, v / fpool::histogram::sub_buckets);
+		if (b > 0) {
+			ASSERT_LT(fpool::histogram::bucket_max(b - 1), v);
+		}
+	}
+
+	fpool::histogram h;
+	for (int i = 1; i <= 1000; ++i)
+		h.record(i);
+
+	ASSERT_EQ(h.count(), 1000);
+	ASSERT_EQ(h.max(), 1000);
+	ASSERT_EQ(h.mean(), 500.5);
+	ASSERT_NEAR(h.percentile(50), 500, 500 / fpool::histogram::sub_buckets);
+	ASSERT_NEAR(h.percentile(99), 990, 990 / fpool::histogram::sub_buckets);
+	ASSERT_EQ(h.percentile(100), 1000);
+}
+
+TEST(fpool, metrics)
+{
+	fpool::options opt;
+	opt.workers = 2;
+	opt.max_in_flight = 4;
+
+	fpool::controller ctl(opt, batch_echo);
+
+	int num = 100;
+	std::atomic_int completed(0);
+	for (int i = 0; i < num; ++i) {
+		ctl.schedule(fpool::message(100), [&] (const fpool::message &) {
+					completed++;
+				});
+	}
+	for (int i = 0; i < 100 && completed != num; ++i)
+		usleep(10000);
+	ASSERT_EQ(completed, num);
+
+	auto m = ctl.metrics();
+	ASSERT_EQ(m.workers.size(), 2);
+	ASSERT_EQ(m.total.requests, num);
+	ASSERT_EQ(m.total.request_bytes, num * 100);
+	ASSERT_EQ(m.total.replies, num);
+	ASSERT_EQ(m.total.reply_bytes, num * 100);
+	ASSERT_EQ(m.total.queue_wait.count(), num);
+	ASSERT_EQ(m.total.service.count(), num);
+	ASSERT_EQ(m.total.latency.count(), num);
+	ASSERT_GE(m.total.latency.percentile(50), m.total.service.percentile(50));
+
+	// sum and maximum are exact, not restored from bucket bounds
+	uint64_t bounds_sum = 0;
+	auto &counts = m.total.latency.counts();
+	for (size_t i = 0; i < counts.size(); ++i) {
+		bounds_sum += counts[i] * fpool::histogram::bucket_max(i);
+	}
+	ASSERT_LT(m.total.latency.sum(), bounds_sum);
+	ASSERT_GE(m.total.latency.max(), m.total.latency.sum() / m.total.latency.count());
+	ASSERT_EQ(m.total.timeouts, 0);
+	ASSERT_EQ(m.total.restarts, 0);
+	ASSERT_EQ(m.total.queued, 0);
+	ASSERT_EQ(m.total.in_flight, 0);
+
+	// requests which do not fit into in-flight window of the slow worker wait in its queue
+	fpool::options slow_opt;
+	slow_opt.workers = 1;
+	slow_opt.max_in_flight = 2;
+
+	fpool::controller slow(slow_opt, [] (const fpool::message &msg) {
+				usleep(100000);
+				return batch_echo(msg);
+			});
+
+	std::atomic_int slow_completed(0);
+	for (int i = 0; i < 5; ++i) {
+		slow.schedule(fpool::message(16), [&] (const fpool::message &) {
+					slow_completed++;
+				});
+	}
+	for (int i = 0; i < 100 && slow.metrics().workers[0].in_flight != 2; ++i)
+		usleep(1000);
+
+	auto sm = slow.metrics();
+	ASSERT_EQ(sm.workers[0].in_flight, 2);
+	ASSERT_EQ(sm.workers[0].queued + sm.workers[0].in_flight + slow_completed, 5);
+	ASSERT_EQ(sm.total.in_flight, sm.workers[0].in_flight);
+	ASSERT_EQ(sm.total.queued, sm.workers[0].queued);
+
+	for (int i = 0; i < 200 && slow_completed != 5; ++i)
+		usleep(10000);
+	ASSERT_EQ(slow_completed, 5);
+	sm = slow.metrics();
+	ASSERT_EQ(sm.workers[0].queued, 0);
+	ASSERT_EQ(sm.workers[0].in_flight, 0);
+
+	// killed worker is replaced and its restart is counted
+	kill(m.workers[0].pid, SIGKILL);
+	for (int i = 0; i < 100 && ctl.metrics().total.restarts != 1; ++i)
+		usleep(10000);
+	ASSERT_EQ(ctl.metrics().total.restarts, 1);
+}
+
+TEST(fpool, future)
+{
+	fpool::options opt;
+	opt.workers = 2;
+	opt.max_in_flight = 8;
+
+	fpool::controller ctl(opt, batch_echo);
+
+	std::vector<std::future<fpool::message>> futures;
+	for (int i = 0; i < 100; ++i) {
+		std::string data = std::to_string(i);
+
+		fpool::message msg(data.size());
+		msg.header.cmd = i;
+		memcpy(msg.data.get(), data.data(), data.size());
+		futures.emplace_back(ctl.schedule(std::move(msg)));
+	}
+
+	for (size_t i = 0; i < futures.size(); ++i) {
+		fpool::message reply = futures[i].get();
+		ASSERT_EQ(reply.header.status, 0);
+		ASSERT_EQ(reply.header.cmd, (int)i);
+		ASSERT_EQ(std::string(reply.data.get(), reply.header.size), std::to_string(i));
+	}
+
+	fpool::controller slow(1, [] (const fpool::message &msg) {
+				usleep(200000);
+				return batch_echo(msg);
+			});
+
+	auto f = slow.schedule(fpool::message(16), std::chrono::system_clock::now() + std::chrono::milliseconds(50));
+	ASSERT_EQ(f.get().header.status, -ETIMEDOUT);
+}
+
+#ifdef RIBOSOME_FPOOL_COROUTINES
+struct detached_task {
+	struct promise_type {
+		detached_task get_return_object() {
+			return detached_task();
+		}
+		std::suspend_never initial_suspend() noexcept {
+			return std::suspend_never();
+		}
+		std::suspend_never final_suspend() noexcept {
+			return std::suspend_never();
+		}
+		void return_void() {
+		}
+		void unhandled_exception() {
+			std::terminate();
+		}
+	};
+};
+
+static detached_task echo_twice(fpool::controller &ctl, std::promise<std::string> &result)
+{
+	fpool::message msg(5);
+	memcpy(msg.data.get(), "hello", 5);
+
+	fpool::message reply = co_await ctl.async(std::move(msg));
+	reply = co_await ctl.async(std::move(reply));
+	result.set_value(std::string(reply.data.get(), reply.header.size));
+}
+
+TEST(fpool, coroutine)
+{
+	fpool::controller ctl(1, batch_echo);
+
+	std::promise<std::string> result;
+	auto f = result.get_future();
+	echo_twice(ctl, result);
+	ASSERT_EQ(f.get(), "hello");
+}
+
+static detached_task echo_status(fpool::controller &ctl, std::promise<int> &result)
+{
+	fpool::message reply = co_await ctl.async(fpool::message(16));
+	result.set_value(reply.header.status);
+}
+
+TEST(fpool, coroutine_rejected)
+{
+	fpool::options opt;
+	opt.workers = 1;
+	opt.queue_limit = 1;
+
+	process_gate gate;
+	fpool::controller ctl(opt, [&] (const fpool::message &msg) {
+				gate.wait();
+				return batch_echo(msg);
+			});
+
+	std::promise<int> held, rejected;
+	auto fheld = held.get_future();
+	auto frejected = rejected.get_future();
+	echo_status(ctl, held);
+	gate.started(1);
+
+	// rejected request is completed within schedule(), coroutine continues in this thread before echo_status() returns
+	echo_status(ctl, rejected);
+	ASSERT_EQ(frejected.wait_for(std::chrono::seconds(0)), std::future_status::ready);
+	ASSERT_EQ(frejected.get(), -EAGAIN);
+
+	gate.release(1);
+	ASSERT_EQ(fheld.get(), 0);
+}
+#endif
+
+// echoes every request chunk back, final reply carries number of chunks and bytes read
+static fpool::message stream_echo(const fpool::message &head, fpool::stream &s)
+{
+	uint64_t chunks = 0, bytes = 0;
+
+	fpool::message chunk;
+	while (s.read(&chunk) == 0) {
+		chunks++;
+		bytes += chunk.header.size;
+
+		// the first chunk tells how many chunks to read before replying
+		if (head.header.cmd && (int)chunks == head.header.cmd)
+			break;
+
+		s.write(std::move(chunk));
+	}
+
+	fpool::message reply(sizeof(uint64_t) * 2);
+	reply.header.cmd = head.header.cmd;
+	memcpy(reply.data.get(), &chunks, sizeof(uint64_t));
+	memcpy(reply.data.get() + sizeof(uint64_t), &bytes, sizeof(uint64_t));
+	return reply;
+}
+
+struct stream_result {
+	std::mutex lock;
+	std::condition_variable cv;
+	bool completed = false;
+	int status = 0;
+	uint64_t chunks = 0, bytes = 0;
+	uint64_t echoed_chunks = 0, echoed_bytes = 0;
+	bool mismatch = false;
+};
+
+static void schedule_stream(fpool::controller &ctl, int cmd, int chunks, size_t chunk_size, stream_result &res)
+{
+	auto sent = std::make_shared<int>(0);
+
+	fpool::message head;
+	head.header.cmd = cmd;
+	ctl.schedule_stream(std::move(head), [=] (fpool::message *chunk) {
+				if (*sent == chunks)
+					return 1;
+
+				*chunk = fpool::message(chunk_size);
+				memset(chunk->data.get(), 'a' + *sent % 26, chunk_size);
+				++*sent;
+				return 0;
+			}, [&] (fpool::message &chunk) {
+				if (chunk.header.size != chunk_size ||
+						chunk.data.get()[0] != (char)('a' + res.echoed_chunks % 26))
+					res.mismatch = true;
+
+				res.echoed_chunks++;
+				res.echoed_bytes += chunk.header.size;
+			}, [&] (fpool::message &reply) {
+				std::unique_lock<std::mutex> guard(res.lock);
+				res.status = reply.header.status;
+				if (reply.header.status == 0 && reply.header.size == sizeof(uint64_t) * 2) {
+					memcpy(&res.chunks, reply.data.get(), sizeof(uint64_t));
+					memcpy(&res.bytes, reply.data.get() + sizeof(uint64_t), sizeof(uint64_t));
+				}
+				res.completed = true;
+				res.cv.notify_one();
+			});
+
+	std::unique_lock<std::mutex> guard(res.lock);
+	res.cv.wait_for(guard, std::chrono::seconds(20), [&] {return res.completed;});
+}
+
+TEST(fpool, stream)
+{
+	fpool::options opt;
+	opt.shm_ring_size = 1024 * 1024;
+	opt.max_in_flight = 4;
+	opt.prefork = true;
+
+	fpool::controller ctl(opt, batch_echo, fpool::worker::batch_callback_t(), stream_echo);
+
+	// 64 MB are streamed in 256 KB chunks in both directions
+	stream_result res;
+	schedule_stream(ctl, 0, 256, 256 * 1024, res);
+	ASSERT_TRUE(res.completed);
+	ASSERT_EQ(res.status, 0);
+	ASSERT_EQ(res.chunks, 256);
+	ASSERT_EQ(res.bytes, 256 * 256 * 1024);
+	ASSERT_EQ(res.echoed_chunks, 256);
+	ASSERT_EQ(res.echoed_bytes, 256 * 256 * 1024);
+	ASSERT_FALSE(res.mismatch);
+
+	// callback returns before the request has ended, the rest of it is dropped
+	stream_result partial;
+	schedule_stream(ctl, 3, 100, 1000, partial);
+	ASSERT_TRUE(partial.completed);
+	ASSERT_EQ(partial.status, 0);
+	ASSERT_EQ(partial.chunks, 3);
+	ASSERT_EQ(partial.echoed_chunks, 2);
+
+	// regular requests are not affected
+	fpool::message reply = ctl.schedule(fpool::message(16)).get();
+	ASSERT_EQ(reply.header.status, 0);
+	ASSERT_EQ(reply.header.size, 16);
+
+	fpool::controller plain(1, batch_echo);
+	stream_result unsupported;
+	schedule_stream(plain, 0, 10, 100, unsupported);
+	ASSERT_TRUE(unsupported.completed);
+	ASSERT_EQ(unsupported.status, -ENOTSUP);
+}
 
 int main(int argc, char **argv)
 {
@@ -0,0 +1,179 @@
+#include "ribosome/fpool.hpp"
+#include "ribosome/timer.hpp"
+
+#include <boost/program_options.hpp>
+
+#include <iostream>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glog/logging.h>
+
+using namespace ioremap::ribosome;
+
+// Throughput and latency of the echo pool for every combination of worker count, payload size and
+// client concurrency. Every client keeps one request in flight and schedules the next one from completion,
+// latency is taken from controller metrics, it is measured from scheduling until completion.
+
+struct bench_config {
+	int workers;
+	size_t size;
+	int concurrency;
+	int messages;
+	fpool::options opt;
+};
+
+class closed_loop {
+public:
+	closed_loop(fpool::controller &ctl, const bench_config &cfg) : m_ctl(ctl), m_cfg(cfg) {
+	}
+
+	void run() {
+		for (int i = 0; i < m_cfg.concurrency && i < m_cfg.messages; ++i) {
+			send();
+		}
+
+		std::unique_lock<std::mutex> guard(m_lock);
+		m_cv.wait(guard, [&] {return m_completed == m_cfg.messages;});
+	}
+
+	int failed() const {
+		return m_failed;
+	}
+
+private:
+	fpool::controller &m_ctl;
+	const bench_config &m_cfg;
+
+	std::atomic_int m_sent{0};
+	std::atomic_int m_failed{0};
+
+	std::mutex m_lock;
+	std::condition_variable m_cv;
+	int m_completed = 0;
+
+	void send() {
+		if (m_sent++ >= m_cfg.messages)
+			return;
+
+		fpool::message msg(m_cfg.size);
+		if (m_cfg.size)
+			memset(msg.data.get(), 'x', m_cfg.size);
+
+		m_ctl.schedule(std::move(msg), [this] (const fpool::message &reply) {
+					if (reply.header.status != 0 || reply.header.size != m_cfg.size)
+						m_failed++;
+
+					send();
+
+					std::unique_lock<std::mutex> guard(m_lock);
+					if (++m_completed == m_cfg.messages)
+						m_cv.notify_one();
+				});
+	}
+};
+
+static void bench(const bench_config &cfg)
+{
+	fpool::options opt = cfg.opt;
+	opt.workers = cfg.workers;
+
+	fpool::controller ctl(opt, [] (const fpool::message &msg) {
+				fpool::message reply(msg.header.size);
+				if (msg.header.size)
+					memcpy(reply.data.get(), msg.data.get(), msg.header.size);
+				return reply;
+			});
+
+	closed_loop loop(ctl, cfg);
+
+	timer tm;
+	loop.run();
+	float sec = tm.elapsed_seconds();
+
+	auto m = ctl.metrics();
+	auto &lat = m.total.latency;
+
+	printf("workers: %3d, size: %9zd, concurrency: %4d, messages: %7d, "
+			"messages/sec: %10.1f, MB/sec: %9.2f, latency usecs: p50: %7lu, p99: %7lu, p999: %7lu, max: %7lu",
+			cfg.workers, cfg.size, cfg.concurrency, cfg.messages,
+			cfg.messages / sec, (double)cfg.size * cfg.messages / sec / (1024 * 1024),
+			lat.percentile(50), lat.percentile(99), lat.percentile(99.9), lat.max());
+	if (loop.failed())
+		printf(", failed: %d", loop.failed());
+	printf("\n");
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	namespace bpo = boost::program_options;
+
+	int num;
+	uint64_t max_bytes;
+	std::vector<int> workers, concurrency;
+	std::vector<size_t> sizes;
+	fpool::options opt;
+
+	bpo::options_description generic("fpool throughput and latency benchmark options");
+	generic.add_options()
+		("help", "this help message")
+		("messages", bpo::value<int>(&num)->default_value(10000), "maximum number of messages per run")
+		("max-bytes", bpo::value<uint64_t>(&max_bytes)->default_value(1024 * 1024 * 1024),
+			"number of messages is reduced so that every run sends at most this many payload bytes")
+		("workers", bpo::value<std::vector<int>>(&workers)->composing(),
+			"number of workers, can be specified multiple times")
+		("size", bpo::value<std::vector<size_t>>(&sizes)->composing(),
+			"payload size, can be specified multiple times")
+		("concurrency", bpo::value<std::vector<int>>(&concurrency)->composing(),
+			"number of requests kept in flight, can be specified multiple times")
+		("max-in-flight", bpo::value<size_t>(&opt.max_in_flight)->default_value(16),
+			"maximum number of in-flight requests per worker")
+		("shm-ring-size", bpo::value<size_t>(&opt.shm_ring_size)->default_value(0),
+			"size of shared memory ring, 0 disables shared memory transport")
+		;
+
+	bpo::variables_map vm;
+	try {
+		bpo::store(bpo::command_line_parser(argc, argv).options(generic).run(), vm);
+
+		if (vm.count("help")) {
+			std::cout << generic << std::endl;
+			return 0;
+		}
+
+		bpo::notify(vm);
+	} catch (const std::exception &e) {
+		std::cerr << "Invalid options: " << e.what() << "\n" << generic << std::endl;
+		return -EINVAL;
+	}
+
+	if (workers.empty())
+		workers = {1, 2, 4, 8};
+	if (sizes.empty())
+		sizes = {0, 128, 4096, 65536, 1024 * 1024, 16 * 1024 * 1024, 64 * 1024 * 1024};
+	if (concurrency.empty())
+		concurrency = {1, 16, 128};
+
+	google::InitGoogleLogging(argv[0]);
+
+	for (auto w: workers) {
+		for (auto size: sizes) {
+			for (auto c: concurrency) {
+				bench_config cfg;
+				cfg.workers = w;
+				cfg.size = size;
+				cfg.concurrency = c;
+				cfg.messages = num;
+				if (size && max_bytes / size < (uint64_t)num)
+					cfg.messages = std::max<uint64_t>(max_bytes / size, 1);
+				cfg.opt = opt;
+
+				bench(cfg);
+			}
+		}
+	}
+
+	return 0;
+}
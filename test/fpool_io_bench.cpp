@@ -0,0 +1,375 @@
+#include "ribosome/fpool.hpp"
+#include "ribosome/timer.hpp"
+
+#include <boost/program_options.hpp>
+
+#include <atomic>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <dlfcn.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+
+using namespace ioremap::ribosome;
+
+// Counts syscalls per message made by the parent IO thread on the real controller IO path and compares them
+// with the old pattern, which added the socket to epoll before every read or write step and removed it afterwards.
+// The benchmark defines the libc syscall wrappers fpool uses and forwards them to the libc implementation,
+// only calls made by threads marked with @counted are counted, so neither the wait thread nor the scheduling one
+// nor forked workers are reported.
+
+enum {
+	sc_epoll_ctl = 0,
+	sc_epoll_wait,
+	sc_sendmsg,
+	sc_recvmsg,
+	sc_send,
+	sc_recv,
+	sc_read,
+	sc_write,
+	sc_max,
+};
+
+static const char *syscall_names[sc_max] = {
+	"epoll_ctl", "epoll_wait", "sendmsg", "recvmsg", "send", "recv", "read", "write",
+};
+
+static std::atomic<long> syscall_counts[sc_max];
+static thread_local bool counted = false;
+
+template <typename T>
+static T real_syscall(const char *name)
+{
+	return (T)dlsym(RTLD_NEXT, name);
+}
+
+extern "C" {
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *ev) __THROW
+{
+	static auto real = real_syscall<int (*)(int, int, int, struct epoll_event *)>("epoll_ctl");
+	if (counted)
+		syscall_counts[sc_epoll_ctl]++;
+	return real(epfd, op, fd, ev);
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+	static auto real = real_syscall<int (*)(int, struct epoll_event *, int, int)>("epoll_wait");
+	if (counted)
+		syscall_counts[sc_epoll_wait]++;
+	return real(epfd, events, maxevents, timeout);
+}
+
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+	static auto real = real_syscall<ssize_t (*)(int, const struct msghdr *, int)>("sendmsg");
+	if (counted)
+		syscall_counts[sc_sendmsg]++;
+	return real(fd, msg, flags);
+}
+
+ssize_t recvmsg(int fd, struct msghdr *msg, int flags)
+{
+	static auto real = real_syscall<ssize_t (*)(int, struct msghdr *, int)>("recvmsg");
+	if (counted)
+		syscall_counts[sc_recvmsg]++;
+	return real(fd, msg, flags);
+}
+
+ssize_t send(int fd, const void *buf, size_t size, int flags)
+{
+	static auto real = real_syscall<ssize_t (*)(int, const void *, size_t, int)>("send");
+	if (counted)
+		syscall_counts[sc_send]++;
+	return real(fd, buf, size, flags);
+}
+
+ssize_t recv(int fd, void *buf, size_t size, int flags)
+{
+	static auto real = real_syscall<ssize_t (*)(int, void *, size_t, int)>("recv");
+	if (counted)
+		syscall_counts[sc_recv]++;
+	return real(fd, buf, size, flags);
+}
+
+ssize_t read(int fd, void *buf, size_t size)
+{
+	static auto real = real_syscall<ssize_t (*)(int, void *, size_t)>("read");
+	if (counted)
+		syscall_counts[sc_read]++;
+	return real(fd, buf, size);
+}
+
+ssize_t write(int fd, const void *buf, size_t size)
+{
+	static auto real = real_syscall<ssize_t (*)(int, const void *, size_t)>("write");
+	if (counted)
+		syscall_counts[sc_write]++;
+	return real(fd, buf, size);
+}
+
+} // extern "C"
+
+struct header {
+	uint64_t size;
+	uint64_t id;
+};
+
+// Echo process of the baseline pattern, it uses blocking IO, its syscalls are not counted.
+class echo_child {
+public:
+	echo_child() {
+		int fd[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fd) < 0)
+			throw std::runtime_error("could not create socketpair");
+
+		m_pid = fork();
+		if (m_pid == 0) {
+			// buffered output of the parent must not be flushed twice
+			::close(fd[0]);
+			run(fd[1]);
+			_exit(0);
+		}
+
+		::close(fd[1]);
+		m_fd = fd[0];
+	}
+
+	~echo_child() {
+		::close(m_fd);
+		kill(m_pid, SIGTERM);
+		waitpid(m_pid, NULL, 0);
+	}
+
+	int fd() const {
+		return m_fd;
+	}
+
+private:
+	int m_fd;
+	pid_t m_pid;
+
+	static bool full_io(int fd, char *ptr, size_t size, bool rd) {
+		size_t done = 0;
+		while (done < size) {
+			ssize_t err = rd ? ::recv(fd, ptr + done, size - done, 0) : ::send(fd, ptr + done, size - done, 0);
+			if (err <= 0)
+				return false;
+			done += err;
+		}
+		return true;
+	}
+
+	void run(int fd) {
+		std::vector<char> data;
+		while (true) {
+			header hdr;
+			if (!full_io(fd, (char *)&hdr, sizeof(hdr), true))
+				return;
+			data.resize(hdr.size);
+			if (!full_io(fd, data.data(), hdr.size, true))
+				return;
+			if (!full_io(fd, (char *)&hdr, sizeof(hdr), false))
+				return;
+			if (!full_io(fd, data.data(), hdr.size, false))
+				return;
+		}
+	}
+};
+
+// The old IO pattern: socket is added to epoll before every read or write step and removed after it.
+class per_call_io {
+public:
+	per_call_io(int fd) : m_fd(fd) {
+		m_efd = epoll_create1(EPOLL_CLOEXEC);
+	}
+
+	~per_call_io() {
+		::close(m_efd);
+	}
+
+	void transfer(char *ptr, size_t size, uint32_t event) {
+		bool rd = event == EPOLLIN;
+		if (size == 0)
+			return;
+
+		wait(event);
+
+		size_t done = 0;
+		while (done < size) {
+			ssize_t err = rd ?
+				::recv(m_fd, ptr + done, size - done, MSG_DONTWAIT) :
+				::send(m_fd, ptr + done, size - done, MSG_DONTWAIT);
+			if (err < 0) {
+				if (errno != EAGAIN)
+					throw std::runtime_error("IO error");
+
+				wait(event);
+				continue;
+			}
+			if (err == 0)
+				throw std::runtime_error("connection reset");
+
+			done += err;
+		}
+	}
+
+private:
+	int m_fd;
+	int m_efd;
+
+	void wait(uint32_t event) {
+		epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = event;
+		ev.data.fd = m_fd;
+		epoll_ctl(m_efd, EPOLL_CTL_ADD, m_fd, &ev);
+
+		while (epoll_wait(m_efd, &ev, 1, -1) != 1 || !(ev.events & event))
+			;
+
+		epoll_ctl(m_efd, EPOLL_CTL_DEL, m_fd, &ev);
+	}
+};
+
+static void print_counts(const char *mode, size_t size, int num, float sec, const long *start)
+{
+	long total = 0;
+	std::ostringstream ss;
+	for (int i = 0; i < sc_max; ++i) {
+		long num_calls = syscall_counts[i] - start[i];
+		total += num_calls;
+		ss << ", " << syscall_names[i] << ": " << std::fixed << std::setprecision(2) << (float)num_calls / num;
+	}
+
+	printf("%-10s size: %8zd, messages: %d, messages/sec: %9.1f, syscalls/message: %6.2f%s\n",
+			mode, size, num, num / sec, (float)total / num, ss.str().c_str());
+}
+
+static void bench_per_call(int num, size_t size)
+{
+	echo_child child;
+	per_call_io io(child.fd());
+	std::vector<char> data(size, 'x');
+
+	long start[sc_max];
+	for (int i = 0; i < sc_max; ++i) {
+		start[i] = syscall_counts[i];
+	}
+
+	counted = true;
+	timer tm;
+	for (int i = 0; i < num; ++i) {
+		header hdr;
+		hdr.size = size;
+		hdr.id = i;
+
+		io.transfer((char *)&hdr, sizeof(hdr), EPOLLOUT);
+		io.transfer(data.data(), size, EPOLLOUT);
+		io.transfer((char *)&hdr, sizeof(hdr), EPOLLIN);
+		io.transfer(data.data(), size, EPOLLIN);
+	}
+
+	float sec = tm.elapsed_seconds();
+	counted = false;
+
+	print_counts("per-call:", size, num, sec, start);
+}
+
+static void bench_fpool(int num, size_t size)
+{
+	fpool::controller ctl(1, [] (const fpool::message &msg) {
+				fpool::message reply(msg.header.size);
+				if (msg.header.size)
+					memcpy(reply.data.get(), msg.data.get(), msg.header.size);
+				return reply;
+			});
+
+	std::mutex lock;
+	std::condition_variable cv;
+	int completed = 0;
+
+	// there is a single IO loop and completions are called from its thread, the first one marks it as counted
+	ctl.schedule(fpool::message(size), [] (const fpool::message &) {
+				counted = true;
+			});
+	ctl.schedule(fpool::message(size)).wait();
+
+	long start[sc_max];
+	for (int i = 0; i < sc_max; ++i) {
+		start[i] = syscall_counts[i];
+	}
+
+	timer tm;
+	for (int i = 0; i < num; ++i) {
+		fpool::message msg(size);
+		if (size)
+			memset(msg.data.get(), 'x', size);
+
+		ctl.schedule(std::move(msg), [&] (const fpool::message &) {
+					std::unique_lock<std::mutex> guard(lock);
+					completed++;
+					cv.notify_one();
+				});
+	}
+
+	std::unique_lock<std::mutex> guard(lock);
+	cv.wait(guard, [&] {return completed == num;});
+
+	float sec = tm.elapsed_seconds();
+	guard.unlock();
+
+	print_counts("fpool:", size, num, sec, start);
+}
+
+int main(int argc, char *argv[])
+{
+	namespace bpo = boost::program_options;
+
+	int num;
+	std::vector<size_t> sizes;
+
+	bpo::options_description generic("fpool IO syscall benchmark options");
+	generic.add_options()
+		("help", "this help message")
+		("messages", bpo::value<int>(&num)->default_value(10000), "number of messages per run")
+		("size", bpo::value<std::vector<size_t>>(&sizes)->composing(), "payload size, can be specified multiple times")
+		;
+
+	bpo::variables_map vm;
+	try {
+		bpo::store(bpo::command_line_parser(argc, argv).options(generic).run(), vm);
+
+		if (vm.count("help")) {
+			std::cout << generic << std::endl;
+			return 0;
+		}
+
+		bpo::notify(vm);
+	} catch (const std::exception &e) {
+		std::cerr << "Invalid options: " << e.what() << "\n" << generic << std::endl;
+		return -EINVAL;
+	}
+
+	if (sizes.empty())
+		sizes = {0, 128, 4096, 65536, 1024 * 1024};
+
+	google::InitGoogleLogging(argv[0]);
+
+	for (auto size: sizes) {
+		bench_per_call(num, size);
+		bench_fpool(num, size);
+	}
+
+	return 0;
+}
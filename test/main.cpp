@@ -1,9 +1,14 @@
 #include "ribosome/expiration.hpp"
+#include "ribosome/sharded_expiration.hpp"
+#include "ribosome/timing_wheel.hpp"
 
 #include <gtest/gtest.h>
 #include <glog/logging.h>
 
 #include <atomic>
+#include <deque>
+
+#include <sys/epoll.h>
 
 using namespace ioremap::ribosome;
 
@@ -45,6 +50,326 @@ TEST(main, expiration)
 	ASSERT_EQ(failed, fn);
 }
 
+// the same scenario as in main.expiration for other backends
+template <typename T>
+static void test_expiration(T &ex)
+{
+	std::atomic_int completed(0), failed(0);
+	std::condition_variable cv;
+
+	std::vector<typename T::token_t> tokens;
+
+	int n = 100;
+	for (int i = 0; i < n; ++i) {
+		auto expires_at = std::chrono::system_clock::now() + std::chrono::milliseconds(1000 + rand() % 1000);
+		auto token = ex.insert(expires_at, [&] () {
+					completed++;
+					cv.notify_one();
+				});
+
+		if (i % 2 == 0)
+			tokens.push_back(token);
+	}
+
+	int fn = tokens.size();
+	for (auto token: tokens) {
+		auto cb = ex.remove(token);
+		if (cb) {
+			failed++;
+			cb();
+		}
+	}
+
+	std::mutex lock;
+	std::unique_lock<std::mutex> l(lock);
+	cv.wait_for(l, std::chrono::seconds(10), [&] {return completed == n;});
+	l.unlock();
+
+	ASSERT_EQ(completed, n);
+	ASSERT_EQ(failed, fn);
+}
+
+TEST(main, expiration_wheel)
+{
+	expiration ex(expiration::backend_wheel, std::chrono::milliseconds(10));
+	test_expiration(ex);
+
+	std::atomic_bool early(false);
+	std::atomic_int completed(0);
+	int n = 100;
+	for (int i = 0; i < n; ++i) {
+		auto expires_at = std::chrono::system_clock::now() + std::chrono::milliseconds(rand() % 200);
+		ex.insert(expires_at, [&, expires_at] () {
+					if (std::chrono::system_clock::now() < expires_at)
+						early = true;
+					completed++;
+				});
+	}
+
+	for (int i = 0; i < 100 && completed != n; ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	ASSERT_EQ(completed, n);
+	ASSERT_FALSE(early);
+}
+
+TEST(main, expiration_steady)
+{
+	for (auto backend: {expiration::backend_map, expiration::backend_wheel}) {
+		expiration::options opt;
+		opt.backend = backend;
+		opt.steady = true;
+
+		expiration ex(opt);
+		ASSERT_GE(ex.fd(), 0);
+		test_expiration(ex);
+
+		std::atomic_int completed(0);
+		auto start = std::chrono::steady_clock::now();
+		ex.insert(start + std::chrono::milliseconds(50), [&] () {completed++;});
+		ex.insert(std::chrono::system_clock::now() + std::chrono::milliseconds(20), [&] () {completed++;});
+
+		for (int i = 0; i < 100 && completed != 2; ++i)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+		ASSERT_EQ(completed, 2);
+		ASSERT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(50));
+	}
+}
+
+TEST(main, expiration_external)
+{
+	expiration::options opt;
+	opt.external = true;
+
+	expiration ex(opt);
+
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	ASSERT_GE(epfd, 0);
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = ex.fd();
+	ASSERT_EQ(epoll_ctl(epfd, EPOLL_CTL_ADD, ex.fd(), &ev), 0);
+
+	// there are no timers, so there are no wakeups
+	ASSERT_EQ(epoll_wait(epfd, &ev, 1, 100), 0);
+
+	int n = 100;
+	std::atomic_int completed(0);
+	std::atomic_bool early(false);
+	for (int i = 0; i < n; ++i) {
+		auto expires_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(rand() % 200);
+		ex.insert(expires_at, [&, expires_at] () {
+					if (std::chrono::steady_clock::now() < expires_at)
+						early = true;
+					completed++;
+				});
+	}
+
+	int wakeups = 0;
+	while (completed != n) {
+		int num = epoll_wait(epfd, &ev, 1, 1000);
+		ASSERT_EQ(num, 1);
+
+		ex.process();
+		wakeups++;
+	}
+
+	ASSERT_FALSE(early);
+	ASSERT_LE(wakeups, n);
+	ASSERT_EQ(epoll_wait(epfd, &ev, 1, 100), 0);
+
+	close(epfd);
+}
+
+TEST(main, expiration_executor)
+{
+	std::mutex lock;
+	std::condition_variable cv;
+	std::deque<std::function<void ()>> tasks;
+	bool need_exit = false;
+
+	std::vector<std::thread> pool;
+	for (int i = 0; i < 4; ++i) {
+		pool.emplace_back([&] () {
+					std::unique_lock<std::mutex> guard(lock);
+					while (true) {
+						cv.wait(guard, [&] {return need_exit || !tasks.empty();});
+						if (tasks.empty())
+							return;
+
+						auto task = std::move(tasks.front());
+						tasks.pop_front();
+
+						guard.unlock();
+						task();
+						guard.lock();
+					}
+				});
+	}
+
+	expiration::options opt;
+	opt.steady = true;
+	opt.dispatch_batch = 100;
+	opt.executor = [&] (std::function<void ()> &&task) {
+		std::lock_guard<std::mutex> guard(lock);
+		tasks.emplace_back(std::move(task));
+		cv.notify_one();
+	};
+
+	// mass expiry: all timers share the same deadline
+	int n = 10000;
+	std::atomic_int completed(0);
+	{
+		expiration ex(opt);
+
+		auto expires_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(50);
+		for (int i = 0; i < n; ++i) {
+			ex.insert(expires_at, [&] () {completed++;});
+		}
+
+		for (int i = 0; i < 500 && completed != n; ++i)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+		auto st = ex.stats();
+		ASSERT_EQ(st.batches, (uint64_t)(n / opt.dispatch_batch));
+		ASSERT_EQ(st.callbacks, (uint64_t)n);
+		ASSERT_GE(st.lateness_sum, st.lateness_max);
+		ASSERT_GE(st.lateness_max, st.lateness_last);
+	}
+	ASSERT_EQ(completed, n);
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		need_exit = true;
+		cv.notify_all();
+	}
+	for (auto &t: pool)
+		t.join();
+}
+
+TEST(main, expiration_slack)
+{
+	for (auto backend: {expiration::backend_map, expiration::backend_wheel}) {
+		expiration::options opt;
+		opt.backend = backend;
+		opt.steady = true;
+
+		expiration ex(opt);
+
+		// deadlines spread over 10ms with 50ms slack fire together
+		int n = 100;
+		std::atomic_int completed(0);
+		std::atomic_bool early(false), late(false);
+		auto start = std::chrono::steady_clock::now() + std::chrono::milliseconds(20);
+		for (int i = 0; i < n; ++i) {
+			auto expires_at = start + std::chrono::microseconds(rand() % 10000);
+			ex.insert(expires_at, [&, expires_at] () {
+						auto now = std::chrono::steady_clock::now();
+						if (now < expires_at)
+							early = true;
+						if (now > expires_at + std::chrono::milliseconds(50 + 100))
+							late = true;
+						completed++;
+					}, std::chrono::milliseconds(50));
+		}
+
+		for (int i = 0; i < 100 && completed != n; ++i)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+		ASSERT_EQ(completed, n);
+		ASSERT_FALSE(early);
+		ASSERT_FALSE(late);
+
+		// wheel counts distinct deadlines at its 1ms resolution, so there are at most 10 of them
+		auto st = ex.stats();
+		ASSERT_GE(st.wakeups_saved, backend == expiration::backend_map ? (uint64_t)n / 2 : 5);
+		ASSERT_LE(st.wakeups_saved, (uint64_t)n - 1);
+	}
+}
+
+TEST(main, sharded_expiration)
+{
+	sharded_expiration ex(4);
+	test_expiration(ex);
+
+	// every callback must be either fired by the expiration thread or returned by remove(), never both
+	std::atomic_int fired(0), removed(0);
+	int threads = 8;
+	int n = 20000;
+
+	std::vector<std::thread> producers;
+	for (int t = 0; t < threads; ++t) {
+		producers.emplace_back([&] () {
+					for (int i = 0; i < n; ++i) {
+						auto expires_at = std::chrono::system_clock::now() + std::chrono::microseconds(rand() % 2000);
+						auto token = ex.insert(expires_at, [&] () {fired++;});
+
+						if (i % 2) {
+							auto cb = ex.remove(token);
+							if (cb)
+								removed++;
+							ASSERT_FALSE((bool)ex.remove(token));
+						}
+					}
+				});
+	}
+
+	for (auto &t: producers)
+		t.join();
+
+	for (int i = 0; i < 1000 && fired + removed != threads * n; ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	ASSERT_EQ(fired + removed, threads * n);
+}
+
+TEST(main, timing_wheel)
+{
+	timing_wheel wheel(12345);
+	std::map<uint64_t, int> expected;
+	std::vector<timing_wheel::token_t> removed;
+
+	int n = 10000;
+	for (int i = 0; i < n; ++i) {
+		// cover every level and timers beyond the range of the top level
+		int bits = rand() % (timing_wheel::slot_bits * timing_wheel::levels + 4);
+		uint64_t tick = wheel.now() + 1 + (rand() & ((1ULL << bits) - 1)) * ((1ULL << bits) / RAND_MAX + 1);
+
+		auto token = wheel.insert(tick, [&, tick] () {
+					expected[tick]--;
+				});
+		if (i % 3 == 0)
+			removed.push_back(token);
+		else
+			expected[tick]++;
+	}
+
+	for (auto token: removed)
+		ASSERT_TRUE((bool)wheel.remove(token));
+	for (auto token: removed)
+		ASSERT_FALSE((bool)wheel.remove(token));
+	ASSERT_EQ(wheel.size(), n - removed.size());
+
+	while (wheel.size()) {
+		uint64_t now = wheel.next_tick();
+		ASSERT_TRUE(now != timing_wheel::never);
+
+		std::vector<timing_wheel::callback_t> expired;
+		wheel.advance(now, &expired);
+
+		for (auto &cb: expired)
+			cb();
+
+		for (auto it = expected.begin(); it != expected.end() && it->first <= now; it = expected.erase(it))
+			ASSERT_EQ(it->second, 0) << "tick: " << it->first << ", now: " << now;
+	}
+
+	ASSERT_TRUE(expected.empty());
+	ASSERT_TRUE(wheel.next_tick() == timing_wheel::never);
+}
+
 int main(int argc, char **argv)
 {
 	google::InitGoogleLogging(argv[0]);